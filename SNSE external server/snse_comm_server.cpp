@@ -2,8 +2,26 @@
 #include <cstring>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <csignal>
+#include <cerrno>
 #include <vector>
+#include <unordered_map>
+#include <map>
+#include <list>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include <ctime>
 #include <sstream>
@@ -11,11 +29,137 @@
 #include <iomanip>
 
 #include <algorithm>
+#include <cmath>
+#include <climits>
+#include <charconv>
 
-void sendResponse(int client_fd, const std::string& code, const std::string& response)
+#include "snse_storage.h"
+
+// Chunk buffers handed back once their bytes are sent, so that a long
+// response doesn't allocate every 64 KiB of it anew. Shared by the workers,
+// which take buffers, and the I/O thread, which gives them back.
+class BufferPool
+{
+public:
+    static const size_t max_buffers = 64;
+
+    // An empty string with room for at least capacity bytes
+    std::string take(size_t capacity)
+    {
+        std::string buffer;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!buffers.empty())
+            {
+                buffer = std::move(buffers.back());
+                buffers.pop_back();
+            }
+        }
+        buffer.reserve(capacity);
+        return buffer;
+    }
+
+    // Keeps buffer for a later take() if it is worth it
+    void give(std::string&& buffer, size_t capacity)
+    {
+        if (buffer.capacity() < capacity)
+            return;
+        buffer.clear();
+        std::lock_guard<std::mutex> lock(mutex);
+        if (buffers.size() < max_buffers)
+            buffers.push_back(std::move(buffer));
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<std::string> buffers;
+};
+
+BufferPool buffer_pool;
+
+// What a handler writes its response into. Whenever a chunk worth of bytes
+// has been written it goes to the sink, so the client gets the first rows
+// while later ones are still being read and a response never sits whole in
+// memory. Up to capture_limit bytes are also kept for the response cache.
+class Output
+{
+public:
+    static const size_t chunk_size = 64 * 1024;
+
+    // data, last: called with every chunk, last is true only for the final one
+    Output(std::function<void(std::string&&, bool)> sink) : sink(std::move(sink))
+    {
+        buffer = buffer_pool.take(chunk_size);
+    }
+
+    ~Output()
+    {
+        buffer_pool.give(std::move(buffer), chunk_size);
+    }
+
+    Output& operator+=(std::string_view data)
+    {
+        if (capturing && capture.size() <= capture_limit)
+            capture.append(data.substr(0, capture_limit + 1 - capture.size()));
+        buffer.append(data);
+        if (buffer.size() >= chunk_size)
+            flush(false);
+        return *this;
+    }
+
+    // Sends what is left, must be called once the response is complete
+    void finish()
+    {
+        flush(true);
+    }
+
+    void startCapture(size_t limit)
+    {
+        capture.clear();
+        capture_limit = limit;
+        capturing = true;
+    }
+
+    // The response since startCapture(), false if it outgrew the limit
+    bool captured(std::string& response)
+    {
+        capturing = false;
+        if (capture.size() > capture_limit)
+            return false;
+        response = std::move(capture);
+        return true;
+    }
+
+private:
+    void flush(bool last)
+    {
+        if (buffer.empty() && !last)
+            return;
+
+        // the sink owns the chunk from here, its buffer comes back through
+        // buffer_pool once sent
+        std::string chunk;
+        chunk.swap(buffer);
+        if (!last)
+            buffer = buffer_pool.take(chunk_size);
+        sink(std::move(chunk), last);
+    }
+
+    std::function<void(std::string&&, bool)> sink;
+    std::string buffer;
+    std::string capture;
+    size_t capture_limit = 0;
+    bool capturing = false;
+};
+
+void sendRaw(Output& out, const std::string& data)
+{
+    out += data;
+}
+
+void sendResponse(Output& out, const std::string& code, const std::string& response)
 {
-    std::string fullResponse = code + "\n" + response + "\r\n";
-    send(client_fd, fullResponse.c_str(), fullResponse.length(), 0);
+    sendRaw(out, code + "\n" + response + "\r\n");
 }
 
 std::string getCurrentDateTime()
@@ -28,543 +172,1304 @@ std::string getCurrentDateTime()
     return oss.str();
 }
 
-class Pair
+struct Param
 {
-public:
-    Pair(std::string _key, std::string _value)
-    {
-        key = _key;
-        value = _value;
-    }
-    std::string key;
-    std::string value;
+    std::string_view key;
+    std::string_view value;     // empty for a bare key such as "stats"
 };
 
-std::vector<Pair> pairs;
+// One request line split in place: every view points into the line it was
+// parsed from, nothing is copied or allocated
+struct Request
+{
+    static const size_t max_params = 8;
+
+    std::string_view method;
+    Param params[max_params];
+    size_t param_count = 0;
+};
 
-// Extracts the numeric part from a field that may look like:
-//   "81.75:graph_Potenza (W)_Energia (Wh)"  -> "81.75"
-//   "81.75"                                  -> "81.75"
-std::string stripGraphMarker(const std::string& field)
+static bool isKeyChar(unsigned char c)
 {
-    size_t colon = field.find(":");
-    if (colon != std::string::npos)
-        return field.substr(0, colon);
-    return field;
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-';
 }
 
-// Extracts the graph label from a field.
-// e.g. "81.75:graph_Potenza (W)_Energia (Wh)" -> "graph_Potenza (W)_Energia (Wh)"
-// Returns "" if no graph marker is present.
-std::string getGraphLabel(const std::string& field)
+// Whole decimal number, optionally negative, and nothing else
+bool parseInteger(std::string_view text, int64_t& value)
 {
-    size_t colon = field.find(":");
-    if (colon != std::string::npos)
-        return field.substr(colon + 1);
-    return "";
+    auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+    return !text.empty() && result.ec == std::errc() && result.ptr == text.data() + text.size();
 }
 
-// Returns the Nth semicolon-separated sensor field from a log line,
-// starting after the date+time prefix (first 17 characters: dd/mm/yyyy;hh:mm;).
-// Fields look like: "81.75:graph_Potenza (W)_Energia (Wh)" or just "81.75"
-std::string getLineSeparatedValue(const std::string& sensor_data, int index)
+// The device is a directory name under devs/, keep clients inside it
+bool validDevice(const std::string& ip)
 {
-    int pos = -1;
-    int i = 0;
+    return !ip.empty() && ip[0] != '.' && ip.find('/') == std::string::npos;
+}
+
+// Parses a request line without its "\r\n": an upper case method, a space
+// and, for GET, "?key=value&key=value...". Any other method keeps the rest
+// unparsed. Returns false on anything else: empty or repeated '&', keys
+// outside [A-Za-z0-9_-], spaces or control characters, too many params.
+bool parseRequestLine(std::string_view line, Request& request)
+{
+    size_t space = 0;
+    while (space < line.size() && line[space] >= 'A' && line[space] <= 'Z')
+        space++;
+    if (space == 0 || space > 8 || space >= line.size() || line[space] != ' ')
+        return false;
+    request.method = line.substr(0, space);
+    request.param_count = 0;
+    if (request.method != "GET")
+        return true;
+
+    std::string_view query = line.substr(space + 1);
+    if (query.empty() || query[0] != '?')
+        return false;
+
+    size_t pos = 1;
     while (true)
     {
-        int value_start = pos + 1;
-        int value_end = sensor_data.find(";", pos + 1);
-        if (value_end == std::string::npos)
-            return "";
+        if (request.param_count == Request::max_params)
+            return false;
+        Param& param = request.params[request.param_count++];
+
+        size_t start = pos;
+        while (pos < query.size() && isKeyChar(query[pos]))
+            pos++;
+        param.key = query.substr(start, pos - start);
+        if (param.key.empty())
+            return false;
+
+        if (pos < query.size() && query[pos] == '=')
+        {
+            start = ++pos;
+            while (pos < query.size() && query[pos] != '&' && query[pos] > ' ' && query[pos] < 0x7f)
+                pos++;
+            param.value = query.substr(start, pos - start);
+        }
+        else
+            param.value = std::string_view();
+
+        if (pos == query.size())
+            return true;
+        if (query[pos] != '&')
+            return false;
+        pos++;
+    }
+}
 
-        if (i == index)
-            return sensor_data.substr(value_start, value_end - value_start);
+// Formats one stored row the same way the text logs did:
+//   dd/mm/yyyy;hh:mm;81.75:graph_Potenza (W)_Energia (Wh);...;
+std::string formatRow(const std::vector<std::string>& labels, int64_t ts, const float* values)
+{
+    std::string line = formatDate(ts) + ";" + formatTime(ts) + ";";
+    for (size_t i = 0; i < labels.size(); i++)
+    {
+        line += formatValue(values[i]);
+        if (!labels[i].empty())
+            line += ":" + labels[i];
+        line += ";";
+    }
+    return line;
+}
+
+// Set by snse_daemon, where the getter keeps the last two days in memory
+const RecentSamples* recent_samples = nullptr;
 
-        i++;
-        pos = value_end;
+// Calls fn(ts, values) for the rows of [from, to), copied from the recent
+// samples when they hold the whole range and read from the segments
+// otherwise. labels gets the columns. False if the device has no history.
+template <typename F>
+bool forEachRow(const std::string& ip, int64_t from, int64_t to, std::vector<std::string>& labels, F fn)
+{
+    SampleBlock recent;
+    if (recent_samples && recent_samples->read(ip, from, to, labels, recent))
+    {
+        for (size_t i = 0; i < recent.rows(); i++)
+            fn(recent.timestamps[i], recent.row(i));
+        return true;
     }
+
+    DeviceStore store;
+    if (!store.open(ip))
+        return false;
+    labels = store.labels;
+    store.forEach(from, to, fn);
+    return true;
 }
 
-void getDays(int client_fd, std::string ip)
+// Formats one aggregated bucket: <period>;total:graph_label;...;
+std::string formatTotals(const DeviceStore& store, const std::string& period, const std::vector<double>& totals)
 {
-    std::ifstream file("devs/" + ip + ".txt");
+    std::string data = period + ";";
+    for (size_t sens_i = 0; sens_i < totals.size(); sens_i++)
+    {
+        // Reattach graph label so Flutter can read it
+        std::string value = std::to_string((float)totals[sens_i]);
+        if (!store.labels[sens_i].empty())
+            value += ":" + store.labels[sens_i];
+        data += value + ";";
+    }
+    return data + "\n";
+}
 
-    if (!file.is_open())
+// Lists the distinct days/months/years in the device history, oldest first,
+// from the period catalog the getter keeps next to the segments
+std::string listPeriods(Output& out, std::string ip, Period period, bool noresponse = false)
+{
+    DeviceStore store;
+    if (!store.open(ip))
     {
-        sendResponse(client_fd, "404 Not Found", "No data found\n");
-        return;
+        if (!noresponse)
+            sendResponse(out, "404 Not Found", "No data found\n");
+        return "";
     }
-    
-    std::vector<std::string> days;
-    std::string line;
-    
-    while (std::getline(file, line))
-    {
-        std::string line_date = line.substr(0, line.find(";"));
-        if (std::find(days.begin(), days.end(), line_date) == days.end())
-            days.push_back(line_date);
-    }
-    
-    file.close();
-    
-    if (days.empty())
-        sendResponse(client_fd, "404 Not Found", "No data found\n");
-    else
+
+    std::string response;
+    for (int64_t start : store.periods(period))
     {
-        std::string response;
-        for (size_t i = 0; i < days.size(); ++i)
-        {
-            response += days[i];
-            if (i != days.size() - 1)
-                response += "\n";
-        }
-        
-        sendResponse(client_fd, "200 OK", response);
+        if (!response.empty())
+            response += "\n";
+        response += formatPeriod(start, period);
+    }
+
+    if (!noresponse)
+    {
+        if (response.empty())
+            sendResponse(out, "404 Not Found", "No data found\n");
+        else
+            sendResponse(out, "200 OK", response);
     }
+    return response;
+}
+
+void getDays(Output& out, std::string ip)
+{
+    listPeriods(out, ip, PERIOD_DAY);
 }
 
-void getDataDay(int client_fd, std::string ip, std::string day)
+// Min/max decimation for graphs. The range is cut into equal time buckets
+// and each one becomes at most two rows holding every sensor's lowest and
+// highest value, in the order they happened, so peaks survive however few
+// points are asked for. Rows must come in time order; state is one bucket.
+class MinMaxBuckets
 {
-    std::ifstream file("devs/" + ip + ".txt");
-    
-    if (!file.is_open())
+public:
+    MinMaxBuckets(int64_t from, int64_t to, size_t buckets, size_t sensors)
+        : from(from), span(std::max<int64_t>(1, to - from)), buckets(std::max<size_t>(1, buckets)),
+          low(sensors), high(sensors), row(sensors)
     {
-        sendResponse(client_fd, "404 Not Found", "No data found\n");
-        return;
     }
 
-    std::vector<std::string> requested_data;
+    template <typename Emit>
+    void add(int64_t ts, const float* values, Emit emit)
+    {
+        int64_t bucket = (ts - from) * (int64_t)buckets / span;
+        if (count > 0 && bucket != current)
+            flush(emit);
+        current = bucket;
 
-    std::string line;
-    std::string date = day; // Expected format: dd/mm/yyyy
+        for (size_t i = 0; i < low.size(); i++)
+        {
+            if (std::isnan(values[i])) continue;
+            if (std::isnan(low[i].value) || values[i] < low[i].value)
+                low[i] = Extreme{ values[i], ts };
+            if (std::isnan(high[i].value) || values[i] > high[i].value)
+                high[i] = Extreme{ values[i], ts };
+        }
+        count++;
+        last_ts = ts;
+        if (count == 1)
+            first_ts = ts;
+    }
 
-    while (std::getline(file, line))
+    template <typename Emit>
+    void flush(Emit emit)
     {
-        if (line.find(date) != std::string::npos)
-            requested_data.push_back(line);
+        if (count == 0) return;
+
+        // first row: whichever extreme came first, stamped at the earliest one
+        int64_t first_row = last_ts, second_row = first_ts;
+        for (size_t i = 0; i < low.size(); i++)
+        {
+            bool low_first = low[i].ts <= high[i].ts;
+            row[i] = low_first ? low[i].value : high[i].value;
+            if (!std::isnan(row[i]))
+            {
+                first_row = std::min(first_row, std::min(low[i].ts, high[i].ts));
+                second_row = std::max(second_row, std::max(low[i].ts, high[i].ts));
+            }
+        }
+        if (first_row > second_row)
+            first_row = second_row = first_ts;  // nothing but NaN
+        emit(first_row, row.data());
+
+        if (second_row != first_row)
+        {
+            for (size_t i = 0; i < low.size(); i++)
+                row[i] = low[i].ts <= high[i].ts ? high[i].value : low[i].value;
+            emit(second_row, row.data());
+        }
+
+        std::fill(low.begin(), low.end(), Extreme());
+        std::fill(high.begin(), high.end(), Extreme());
+        count = 0;
     }
 
-    file.close();
+private:
+    struct Extreme
+    {
+        float value = NAN;
+        int64_t ts = 0;
+    };
+
+    int64_t from;
+    int64_t span;
+    size_t buckets;
+    std::vector<Extreme> low;
+    std::vector<Extreme> high;
+    std::vector<float> row;
+    int64_t current = 0;
+    size_t count = 0;
+    int64_t first_ts = 0;
+    int64_t last_ts = 0;
+};
+
+// Largest points= accepted, well above any screen width
+const size_t max_points = 100000;
 
-    if (requested_data.empty())
-        sendResponse(client_fd, "404 Not Found", "No data found\n");
+// points: 0 for every sample, otherwise at most that many rows (min/max
+// pairs, see MinMaxBuckets)
+void getDataDay(Output& out, std::string ip, std::string day, size_t points)
+{
+    int64_t from, to;
+    std::vector<std::string> labels;
+
+    // the status line goes out with the first row, a day at one second
+    // sampling is megabytes and is streamed as it is read
+    bool found = false;
+    auto emit = [&](int64_t ts, const float* values)
+    {
+        out += found ? "\n" : "200 OK\n";
+        out += formatRow(labels, ts, values);
+        found = true;
+    };
+
+    bool exists;
+    if (!parseDayRange(day, from, to))
+        exists = false;
+    else if (points == 0)
+        exists = forEachRow(ip, from, to, labels, emit);
     else
     {
-        std::string response;
-        for (size_t i = 0; i < requested_data.size(); ++i)
+        // the column count is only known once the rows are found
+        std::unique_ptr<MinMaxBuckets> buckets;
+        exists = forEachRow(ip, from, to, labels, [&](int64_t ts, const float* values)
         {
-            response += requested_data[i];
-            if (i != requested_data.size() - 1)
-                response += "\n";
-        }
+            if (!buckets)
+                buckets.reset(new MinMaxBuckets(from, to, points / 2, labels.size()));
+            buckets->add(ts, values, emit);
+        });
+        if (buckets)
+            buckets->flush(emit);
+    }
 
-        sendResponse(client_fd, "200 OK", response);
+    if (!exists)
+    {
+        sendResponse(out, "404 Not Found", "No data found\n");
+        return;
     }
+    if (found)
+        out += "\r\n";
+    else
+        sendResponse(out, "404 Not Found", "No data found\n");
 }
 
-std::string getMonths(int client_fd, std::string ip, bool noresponse = false)
+std::string getMonths(Output& out, std::string ip, bool noresponse = false)
 {
-    std::ifstream file("devs/" + ip + ".txt");
-    
-    if (!file.is_open())
-    {
-        sendResponse(client_fd, "404 Not Found", "No data found\n");
-        return "";
-    }
+    return listPeriods(out, ip, PERIOD_MONTH, noresponse);
+}
 
-    std::vector<std::string> months;
-    std::string line;
+// Turns day or month rollups into formatTotals() lines. Each sensor total is
+// the sum of every sample times the time since the previous one, i.e. the
+// energy for power sensors, so any sampling interval gives the same units.
+std::string sumPeriods(const DeviceStore& store, int64_t from, int64_t to, Period period)
+{
+    std::string prepared_data;
+    std::vector<double> totals(store.sensorCount());
 
-    while (std::getline(file, line))
+    for (const Rollup& rollup : store.rollups(from, to, period))
     {
-        std::string line_date = line.substr(0, line.find(";"));
-        std::string line_month = line_date.substr(3, 7);
-
-        if (std::find(months.begin(), months.end(), line_month) == months.end())
-            months.push_back(line_month);
+        for (size_t sens_i = 0; sens_i < totals.size(); sens_i++)
+            totals[sens_i] = rollup.sensors[sens_i].energy;
+        prepared_data += formatTotals(store, formatPeriod(rollup.start, period), totals);
     }
+    return prepared_data;
+}
 
-    file.close();
+std::string getTotalDataMonth(Output& out, std::string ip, std::string month, bool noresponse = false)
+{
+    int64_t from, to;
+    DeviceStore store;
+    std::string prepared_data;
 
-    if (months.empty())
+    if (parseMonthRange(month, from, to) && store.open(ip))
+        prepared_data = sumPeriods(store, from, to, PERIOD_DAY);
+
+    if (prepared_data == "")
     {
         if (!noresponse)
-            sendResponse(client_fd, "404 Not Found", "No data found\n");
+            sendResponse(out, "404 Not Found", "No data found\n");
         return "";
     }
     else
     {
-        std::string response;
-        for (size_t i = 0; i < months.size(); ++i)
-        {
-            response += months[i];
-            if (i != months.size() - 1)
-                response += "\n";
-        }
-
         if (!noresponse)
-            sendResponse(client_fd, "200 OK", response);
-        return response;
+            sendResponse(out, "200 OK", prepared_data);
+        return prepared_data;
     }
 }
 
-int count(std::string line, std::string to_count, int offset)
+void getYears(Output& out, std::string ip)
 {
-    int counter = 0;
-    int pos = offset;
-    
-    while (true)
-    {
-        if ((pos = line.find(to_count, pos + 1)) != std::string::npos)
-            counter++;
-        else break;
-    }
-    return counter;
+    listPeriods(out, ip, PERIOD_YEAR);
 }
 
-std::string getTotalDataMonth(int client_fd, std::string ip, std::string month, bool noresponse = false)
+void getDataYear(Output& out, std::string ip, std::string year)
 {
-    std::ifstream file("devs/" + ip + ".txt");
-    
-    if (!file.is_open())
-    {
-        sendResponse(client_fd, "404 Not Found", "No data found\n");
-        return "";
-    }
+    int64_t from, to;
+    DeviceStore store;
+    std::string prepared_data;
 
-    std::vector<std::string> days;
-    std::string line;
+    if (parseYearRange(year, from, to) && store.open(ip))
+        prepared_data = sumPeriods(store, from, to, PERIOD_MONTH);
 
-    int sensor_number = 0;
-    std::vector<std::vector<float>> days_total_sensors;
-    // Graph labels per sensor, e.g. "graph_Potenza (W)_Energia (Wh)"
-    // Used to reconstruct the output line so the Flutter code can still read labels.
-    std::vector<std::string> graph_labels;
-    
-    int day_i = -1;
-    int line_i = 0;
+    if (prepared_data == "")
+        sendResponse(out, "404 Not Found", "No data found\n");
+    else
+        sendResponse(out, "200 OK", prepared_data);
+}
 
-    float time_interval_calibration_value = 1.0f;   // time_interval (minutes) / 60
-    std::string first_line = "";
+// Where a device stands: the getter rewrites the index on every append,
+// so any new sample changes its modification time or size
+struct DeviceStamp
+{
+    int64_t mtime_ns = 0;
+    int64_t size = -1;
 
-    bool first = true;
-    std::string current_day = "";
+    bool operator==(const DeviceStamp& other) const { return mtime_ns == other.mtime_ns && size == other.size; }
+};
 
-    while (std::getline(file, line))
+DeviceStamp deviceStamp(const std::string& ip)
+{
+    DeviceStamp stamp;
+    struct stat st;
+    if (stat((deviceDir(ip) + "index").c_str(), &st) == 0)
     {
-        if (first_line == "")
-            first_line = line;
+        stamp.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        stamp.size = st.st_size;
+    }
+    return stamp;
+}
 
-        if (first)
-        {
-            first = false;
-            // Count sensors: semicolons after position 16 (past dd/mm/yyyy;hh:mm)
-            sensor_number = count(line, ";", 16);
-            if (sensor_number == 0) return "";
-
-            // Extract graph labels from first line
-            std::string sensor_data = line.substr(17);
-            graph_labels.resize(sensor_number);
-            for (int i = 0; i < sensor_number; i++)
-            {
-                std::string field = getLineSeparatedValue(sensor_data, i);
-                graph_labels[i] = getGraphLabel(field);
-            }
-        }
+// Bounded LRU of "200 OK" responses, shared by the workers. A response for a
+// period that is over never changes and is served until evicted; any other
+// response is only valid while the device stamp it was computed at holds.
+class ResponseCache
+{
+public:
+    void setLimit(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        max_bytes = bytes;
+        evict();
+    }
+
+    size_t limit()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return max_bytes;
+    }
 
-        if (line_i == 1)
+    bool get(const std::string& key, const DeviceStamp& stamp, std::string& response)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(key);
+        if (it == entries.end() || (!it->second->closed && !(it->second->stamp == stamp)))
         {
-            int this_line_minutes = std::stoi(line.substr(15, 2));
-            int first_line_minutes = std::stoi(first_line.substr(15, 2));
-            int time_interval = abs(this_line_minutes - first_line_minutes);
-            time_interval_calibration_value = time_interval / 60.0f;
+            misses++;
+            return false;
         }
+        lru.splice(lru.begin(), lru, it->second);
+        response = it->second->response;
+        hits++;
+        return true;
+    }
 
-        std::string linedate = line.substr(0, line.find(";"));
-        std::string linemonth = linedate.substr(3, 7);
-
-        if (linemonth == month)
+    void put(const std::string& key, const DeviceStamp& stamp, bool closed, const std::string& response)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(key);
+        if (it != entries.end())
         {
-            if (linedate != current_day)
-            {
-                current_day = linedate;
-                days.push_back(linedate);
-                days_total_sensors.push_back(std::vector<float>(sensor_number, 0.0f));
-                day_i++;
-            }
-
-            std::string sensor_data = line.substr(17);
-            for (int sens_i = 0; sens_i < sensor_number; sens_i++)
-            {
-                std::string field = getLineSeparatedValue(sensor_data, sens_i);
-                std::string numeric = stripGraphMarker(field);
-                try {
-                    float parsed = std::stof(numeric);
-                    days_total_sensors[day_i][sens_i] += parsed * time_interval_calibration_value;
-                } catch (...) {}
-            }
+            bytes -= it->second->key.size() + it->second->response.size();
+            lru.erase(it->second);
+            entries.erase(it);
         }
+        if (key.size() + response.size() > max_bytes)
+            return;
 
-        line_i++;
+        lru.push_front(Entry{ key, response, stamp, closed });
+        entries[key] = lru.begin();
+        bytes += key.size() + response.size();
+        evict();
     }
-    
-    file.close();
 
-    std::string prepared_data = "";
-    for (int day_i = 0; day_i < (int)days.size(); day_i++)
+    std::string stats()
     {
-        std::string data = days[day_i] + ";";
-        std::vector<float> sensors = days_total_sensors[day_i];
+        std::lock_guard<std::mutex> lock(mutex);
+        return "hits: " + std::to_string(hits) + "\nmisses: " + std::to_string(misses) +
+               "\nentries: " + std::to_string(entries.size()) + "\nbytes: " + std::to_string(bytes);
+    }
+
+private:
+    struct Entry
+    {
+        std::string key;
+        std::string response;
+        DeviceStamp stamp;
+        bool closed;
+    };
 
-        for (int sens_i = 0; sens_i < (int)sensors.size(); sens_i++)
+    void evict()
+    {
+        while (bytes > max_bytes && !lru.empty())
         {
-            // Reattach graph label so downstream (getDataYear) and Flutter can read it
-            std::string value = std::to_string(sensors[sens_i]);
-            if (!graph_labels[sens_i].empty())
-                value += ":" + graph_labels[sens_i];
-            data += value + ";";
+            bytes -= lru.back().key.size() + lru.back().response.size();
+            entries.erase(lru.back().key);
+            lru.pop_back();
         }
-        data += "\n";
-        prepared_data += data;
     }
 
-    if (prepared_data == "")
-    {
-        if (!noresponse)
-            sendResponse(client_fd, "404 Not Found", "No data found\n");
+    std::mutex mutex;
+    std::list<Entry> lru;   // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> entries;
+    size_t bytes = 0;
+    size_t max_bytes = 64 * 1024 * 1024;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+ResponseCache response_cache;
+
+// Samples are stamped when the getter polls, but may reach the disk a bit later
+const int64_t period_settle_time = 10 * 60;
+
+// True if the day/month/year asked for ended long enough ago that no new
+// sample can land in it. Listings always include the current period.
+bool periodClosed(const std::string& timeframe, const std::string& data)
+{
+    int64_t from, to;
+    bool parsed = false;
+    if (timeframe == "days")
+        parsed = parseDayRange(data, from, to);
+    else if (timeframe == "months")
+        parsed = parseMonthRange(data, from, to);
+    else if (timeframe == "years")
+        parsed = parseYearRange(data, from, to);
+    return parsed && to + period_settle_time <= (int64_t)std::time(nullptr);
+}
+
+// The newest day, month or year with data, as the listings print it
+std::string latestPeriod(const std::string& ip, const std::string& timeframe)
+{
+    Period period;
+    if (timeframe == "days")
+        period = PERIOD_DAY;
+    else if (timeframe == "months")
+        period = PERIOD_MONTH;
+    else if (timeframe == "years")
+        period = PERIOD_YEAR;
+    else
         return "";
+
+    DeviceStore store;
+    int64_t last = store.open(ip) ? store.lastTimestamp() : 0;
+    return last > 0 ? formatPeriod(last, period) : "";
+}
+
+void getTimeData(Output& out, std::string ip, const std::string& timeframe, const std::string& data, size_t points)
+{
+    if (timeframe == "days")
+    {
+        if (data.empty())
+            getDays(out, ip);
+        else
+            getDataDay(out, ip, data, points);
     }
-    else
+    else if (timeframe == "months")
     {
-        if (!noresponse)
-            sendResponse(client_fd, "200 OK", prepared_data);
-        return prepared_data;
+        if (data.empty())
+            getMonths(out, ip);
+        else
+            getTotalDataMonth(out, ip, data);
     }
+    else if (timeframe == "years")
+    {
+        if (data.empty())
+            getYears(out, ip);
+        else
+            getDataYear(out, ip, data);
+    }
+    else
+        sendResponse(out, "400 Invalid request", "Unknown timeframe");
 }
 
-void getYears(int client_fd, std::string ip)
+// Runs handler(out) through the response cache. The stamp is taken before
+// the history is read, so a sample appended meanwhile invalidates the entry.
+// closed: the response covers a period that is over and can't change.
+template <typename Handler>
+void cachedResponse(Output& out, const std::string& ip, const std::string& key, bool closed, Handler handler)
 {
-    std::ifstream file("devs/" + ip + ".txt");
-    
-    if (!file.is_open())
+    DeviceStamp stamp = deviceStamp(ip);
+    std::string response;
+    if (response_cache.get(key, stamp, response))
     {
-        sendResponse(client_fd, "404 Not Found", "No data found\n");
+        sendRaw(out, response);
         return;
     }
 
-    std::vector<std::string> years;
-    std::string line;
+    out.startCapture(response_cache.limit());
+    handler(out);
+    if (out.captured(response) && response.compare(0, 6, "200 OK") == 0)
+        response_cache.put(key, stamp, closed, response);
+}
 
-    while (std::getline(file, line))
+void getCachedTimeData(Output& out, const std::string& ip, const std::string& timeframe, const std::string& data,
+                       size_t points)
+{
+    std::string key = ip + "\n" + timeframe + "\n" + data + "\n" + std::to_string(points);
+    cachedResponse(out, ip, key, !data.empty() && periodClosed(timeframe, data), [&](Output& out)
     {
-        std::string line_date = line.substr(0, line.find(";"));
-        std::string line_year = line_date.substr(6, 4);
+        getTimeData(out, ip, timeframe, data, points);
+    });
+}
+
+// What a bucket of a range query reports for every sensor
+enum RangeValue { RANGE_MEAN, RANGE_MIN, RANGE_MAX, RANGE_ENERGY };
 
-        if (std::find(years.begin(), years.end(), line_year) == years.end())
-            years.push_back(line_year);
+bool parseRangeValue(const std::string& text, RangeValue& value)
+{
+    static const char* names[] = { "mean", "min", "max", "energy" };
+    for (int i = 0; i < 4; i++)
+    {
+        if (text == names[i])
+        {
+            value = (RangeValue)i;
+            return true;
+        }
     }
+    return false;
+}
 
-    file.close();
+// Longest step= accepted, a year
+const int64_t max_step = 366LL * 24 * 3600;
 
-    if (years.empty())
-        sendResponse(client_fd, "404 Not Found", "No data found\n");
-    else
+// Range ends accepted, up to the end of year 9999 UTC; nothing is older than 1970
+const int64_t max_epoch = 253402300799LL;
+
+// Bucket size: seconds, or a number followed by s, m, h or d ("15m", "1d")
+bool parseStep(const std::string& text, int64_t& step)
+{
+    char* end;
+    long long count = strtoll(text.c_str(), &end, 10);
+    const char* digits_end = end;
+    int64_t unit = 1;
+    if (*end == 'm') unit = 60;
+    else if (*end == 'h') unit = 3600;
+    else if (*end == 'd') unit = 24 * 3600;
+    else if (*end != 's' && *end != '\0') return false;
+    if (*end != '\0') end++;
+
+    // count can be anything up to LLONG_MAX, bound it before multiplying
+    if (digits_end == text.c_str() || *end != '\0' || count <= 0 || count > max_step / unit)
+        return false;
+    step = count * unit;
+    return true;
+}
+
+// Rows of [from, to): the samples themselves if step is 0, otherwise one per
+// non-empty bucket of step seconds, stamped with the bucket start and
+// aggregated by the storage layer
+void getRange(Output& out, const std::string& ip, int64_t from, int64_t to, int64_t step, RangeValue value)
+{
+    std::vector<std::string> labels;
+    bool found = false;
+    auto emit = [&](int64_t ts, const float* values)
     {
-        std::string response;
-        for (size_t i = 0; i < years.size(); ++i)
+        out += found ? "\n" : "200 OK\n";
+        out += formatRow(labels, ts, values);
+        found = true;
+    };
+
+    DeviceStore store;
+    if (step == 0 ? !forEachRow(ip, from, to, labels, emit) : !store.open(ip))
+    {
+        sendResponse(out, "404 Not Found", "No data found\n");
+        return;
+    }
+
+    if (step != 0)
+    {
+        labels = store.labels;
+        std::vector<float> values(store.sensorCount());
+        for (const Rollup& bucket : store.aggregate(from, to, step))
         {
-            response += years[i];
-            if (i != years.size() - 1)
-                response += "\n";
+            for (size_t i = 0; i < values.size(); i++)
+            {
+                const SensorRollup& sensor = bucket.sensors[i];
+                if (value == RANGE_ENERGY)
+                    values[i] = sensor.energy;
+                else if (sensor.count == 0)
+                    values[i] = NAN;
+                else if (value == RANGE_MEAN)
+                    values[i] = sensor.sum / sensor.count;
+                else
+                    values[i] = value == RANGE_MIN ? sensor.min : sensor.max;
+            }
+            emit(bucket.start, values.data());
         }
-
-        sendResponse(client_fd, "200 OK", response);
     }
+
+    if (found)
+        out += "\r\n";
+    else
+        sendResponse(out, "404 Not Found", "No data found\n");
 }
 
-void getDataYear(int client_fd, std::string ip, std::string year)
+void getCachedRange(Output& out, const std::string& ip, int64_t from, int64_t to, int64_t step, RangeValue value)
 {
-    int month_pos = -1;
-    std::string months = getMonths(client_fd, ip, true);
-    if (months == "") return;
+    std::string key = ip + "\nrange\n" + std::to_string(from) + "\n" + std::to_string(to) + "\n" +
+                      std::to_string(step) + "\n" + std::to_string(value);
+    bool closed = to + period_settle_time <= (int64_t)std::time(nullptr);
+    cachedResponse(out, ip, key, closed, [&](Output& out)
+    {
+        getRange(out, ip, from, to, step, value);
+    });
+}
 
-    std::vector<std::string> months_vec;
-    std::vector<std::vector<float>> months_total_sensors;
-    std::vector<std::string> graph_labels;
-    bool first = true;
-    int month_i = 0;
+void handleGET(Output& out, const Request& request)
+{
+    const Param* pairs = request.params;
 
-    do {
-        std::string this_month = months.substr(month_pos + 1, 7);
-        std::cout << this_month << std::endl;
+    if (pairs[0].key == "stats")
+    {
+        sendResponse(out, "200 OK", response_cache.stats());
+        return;
+    }
 
-        std::string this_year = this_month.substr(3, 4);
-        if (this_year != year) continue;
+    if (pairs[0].key != "dev")
+    {
+        sendResponse(out, "400 Invalid request", "Request must start with dev=<ip>!");
+        return;
+    }
+    std::string ip(pairs[0].value);
+    if (!validDevice(ip))
+    {
+        sendResponse(out, "400 Invalid request", "Invalid device");
+        return;
+    }
 
-        std::string month_data = getTotalDataMonth(client_fd, ip, this_month, true);
-        if (month_data.empty()) continue;
+    if (request.param_count < 2)
+    {
+        sendResponse(out, "400 Invalid request", "Unknown command");
+        return;
+    }
 
-        months_vec.push_back(this_month);
+    if (pairs[1].key == "time")
+    {
+        // time=<frame>[&data=<period>|&latest][&points=N]
+        std::string timeframe(pairs[1].value);
+        std::string data;
+        bool latest = false;
+        size_t next = 2;
+        if (next < request.param_count && pairs[next].key == "data")
+            data = std::string(pairs[next++].value);
+        else if (next < request.param_count && pairs[next].key == "latest" && pairs[next].value.empty())
+        {
+            latest = true;
+            next++;
+        }
 
-        // Parse each day line in month_data: day;sensor1;sensor2;...\n
-        std::istringstream stream(month_data);
-        std::string day_line;
-        bool month_first = true;
+        // optional &points=N, for graphs of a day
+        size_t points = 0;
+        if (next < request.param_count && pairs[next].key == "points")
+        {
+            int64_t count;
+            points = parseInteger(pairs[next++].value, count) && count > 0 ? count : 0;
+            if (points < 2 || points > max_points)
+            {
+                sendResponse(out, "400 Invalid request", "points must be between 2 and " + std::to_string(max_points));
+                return;
+            }
+        }
 
-        while (std::getline(stream, day_line))
+        if (next < request.param_count)
+        {
+            sendResponse(out, "400 Invalid request", "Unknown command");
+            return;
+        }
+        // checked here too so that &latest answers it once, not twice
+        if (timeframe != "days" && timeframe != "months" && timeframe != "years")
         {
-            if (day_line.empty()) continue;
+            sendResponse(out, "400 Invalid request", "Unknown timeframe");
+            return;
+        }
 
-            // sensor fields start after first ";" (the date)
-            std::string sensor_data = day_line.substr(day_line.find(";") + 1);
-            int sensors_number = count(sensor_data, ";", 0);
+        if (!latest)
+        {
+            getCachedTimeData(out, ip, timeframe, data, points);
+            return;
+        }
 
-            if (first)
-            {
-                first = false;
-                graph_labels.resize(sensors_number);
-                for (int i = 0; i < sensors_number; i++)
-                {
-                    std::string field = getLineSeparatedValue(sensor_data, i);
-                    graph_labels[i] = getGraphLabel(field);
-                }
-            }
+        // what opening a graph takes, in one round trip: the list of periods,
+        // then the data of the newest one, as two responses back to back
+        getCachedTimeData(out, ip, timeframe, "", 0);
+        std::string newest = latestPeriod(ip, timeframe);
+        if (newest.empty())
+            sendResponse(out, "404 Not Found", "No data found\n");
+        else
+            getCachedTimeData(out, ip, timeframe, newest, points);
+    }
+    else if (pairs[1].key == "from")
+    {
+        // from=<epoch>&to=<epoch>[&step=<size>][&value=mean|min|max|energy]
+        int64_t from = 0;
+        int64_t to = 0;
+        int64_t step = 0;
+        RangeValue value = RANGE_MEAN;
+        bool valid = parseInteger(pairs[1].value, from);
+        for (size_t i = 2; i < request.param_count; i++)
+        {
+            std::string text(pairs[i].value);
+            if (pairs[i].key == "to")
+                valid = valid && parseInteger(pairs[i].value, to);
+            else if (pairs[i].key == "step")
+                valid = valid && parseStep(text, step);
+            else if (pairs[i].key == "value")
+                valid = valid && parseRangeValue(text, value);
+            else
+                valid = false;
+        }
 
-            if (month_first)
-            {
-                month_first = false;
-                months_total_sensors.push_back(std::vector<float>(sensors_number, 0.0f));
-            }
+        if (!valid || from < 0 || to > max_epoch || from >= to)
+            sendResponse(out, "400 Invalid request", "Invalid range");
+        else if (step > 0 && (uint64_t)(to - from) / step >= max_points)
+            sendResponse(out, "400 Invalid request", "Too many steps, at most " + std::to_string(max_points));
+        else
+            getCachedRange(out, ip, from, to, step, value);
+    }
+    else
+        sendResponse(out, "400 Invalid request", "Unknown command");
+}
+
+void handlePOST(Output& out, const Request&)
+{
+    sendResponse(out, "400 Invalid request", "POST requests are not supported yet");
+}
+
+// Answer to a line parseRequestLine() rejects
+const std::string malformed_response = "400 Invalid request\nMalformed request\r\n";
+
+// Runs on a worker thread: everything it touches must be local or read-only
+void handleRequest(Output& out, const std::string& line)
+{
+    Request request;
+    if (!parseRequestLine(line, request))
+        sendRaw(out, malformed_response);
+    else if (request.method == "GET")
+        handleGET(out, request);
+    else if (request.method == "POST")
+        handlePOST(out, request);
+    else
+        sendResponse(out, "400 Invalid request", "Only POST and GET requests are supported");
+}
+
+// Fixed-size pool running request handlers off the I/O thread
+class WorkerPool
+{
+public:
+    void start(size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+            threads.emplace_back([this] { run(); });
+    }
+
+    void submit(std::function<void()> job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(std::move(job));
+        }
+        cv.notify_one();
+    }
 
-            for (int sens_i = 0; sens_i < sensors_number; sens_i++)
+private:
+    void run()
+    {
+        while (true)
+        {
+            std::function<void()> job;
             {
-                std::string field = getLineSeparatedValue(sensor_data, sens_i);
-                std::string numeric = stripGraphMarker(field);
-                try {
-                    months_total_sensors[month_i][sens_i] += std::stof(numeric);
-                } catch (...) {}
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this] { return !jobs.empty(); });
+                job = std::move(jobs.front());
+                jobs.pop_front();
             }
+            job();
         }
+    }
 
-        month_i++;
-    } while ((month_pos = months.find("\n", month_pos + 1)) != std::string::npos);
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> jobs;
+};
 
-    std::string prepared_data = "";
-    for (int m_i = 0; m_i < (int)months_vec.size(); m_i++)
+// Who is waiting for an in-flight request
+struct Waiter
+{
+    int fd;
+    uint64_t connection_id;
+    uint64_t sequence;
+};
+
+// A request being answered by a worker. The worker stops once max_unsent
+// bytes of its response are waiting to be sent and goes on as clients read
+// them, so a long response takes little memory. A client that stops reading
+// for stall_timeout no longer holds it back, the rest is buffered instead.
+class Job
+{
+public:
+    static const size_t max_unsent = 256 * 1024;
+    static constexpr std::chrono::seconds stall_timeout{ 30 };
+
+    std::string request;
+    std::vector<Waiter> waiters;    // I/O thread only
+    bool started = false;           // I/O thread only, part of the response went out
+
+    void acquire(size_t bytes)
     {
-        std::string data = months_vec[m_i] + ";";
-        std::vector<float> sensors = months_total_sensors[m_i];
+        std::lock_guard<std::mutex> lock(mutex);
+        unsent += bytes;
+    }
 
-        for (int sens_i = 0; sens_i < (int)sensors.size(); sens_i++)
+    void release(size_t bytes)
+    {
         {
-            std::string value = std::to_string(sensors[sens_i]);
-            if (!graph_labels[sens_i].empty())
-                value += ":" + graph_labels[sens_i];
-            data += value + ";";
+            std::lock_guard<std::mutex> lock(mutex);
+            unsent -= bytes;
         }
-        data += "\n";
-        prepared_data += data;
+        cv.notify_all();
     }
 
-    if (prepared_data == "")
-        sendResponse(client_fd, "404 Not Found", "No data found\n");
-    else
-        sendResponse(client_fd, "200 OK", prepared_data);
-}
+    // Worker side, after handing over a chunk
+    void waitForRoom()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!stalled)
+            stalled = !cv.wait_for(lock, stall_timeout, [this] { return unsent <= max_unsent; });
+    }
 
-void handleGET(int client_fd, std::string req)
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t unsent = 0;
+    bool stalled = false;
+};
+
+// Response bytes queued for a client, counted against the job producing
+// them (if any) until they are sent or the client goes away
+struct Chunk
+{
+    std::string data;
+    std::shared_ptr<Job> job;
+
+    Chunk(std::string data, std::shared_ptr<Job> job) : data(std::move(data)), job(std::move(job))
+    {
+        if (this->job)
+            this->job->acquire(this->data.size());
+    }
+    Chunk(Chunk&&) = default;
+    Chunk& operator=(Chunk&&) = delete;
+    ~Chunk()
+    {
+        if (job)
+            job->release(data.size());
+        buffer_pool.give(std::move(data), Output::chunk_size);
+    }
+};
+
+struct PendingResponse
 {
-    req = req.erase(0, req.find(" ") + 2); // Remove "GET ?"
+    std::deque<Chunk> chunks;
+    bool complete = false;
+};
 
-    pairs.clear();
+const size_t max_request_size = 64 * 1024;
 
-    int key_value_pairs = 0;
+// Requests a client may have waiting for an answer. Past that its input is
+// left in the socket until answers go out, so pipelining can't pile up work.
+const uint64_t max_pipelined = 32;
 
-    if (req.find("&") == std::string::npos)
-        key_value_pairs = 1;
-    else
+// A client of the reactor in main(). Requests are framed on "\r\n" and
+// numbered; responses come back from the workers in chunks and in any order,
+// so they wait in done until every earlier one has been queued in out.
+class Connection
+{
+public:
+    uint64_t id = 0;
+    std::string in;
+    size_t scanned = 0;     // where to resume looking for "\r\n" in in
+    std::deque<Chunk> out;
+    size_t out_pos = 0;     // bytes of out.front() already sent
+    uint64_t next_request = 0;
+    uint64_t next_response = 0;
+    std::map<uint64_t, PendingResponse> done;
+    bool closing = false;   // client is gone or misbehaved, close once everything is sent
+
+    // The response being sent has more chunks coming
+    bool streaming() const { return done.count(next_response) != 0; }
+
+    bool backlogged() const { return next_request - next_response >= max_pipelined; }
+};
+
+struct Completion
+{
+    std::shared_ptr<Job> job;
+    std::string data;
+    bool last;
+};
+
+// Chunks handed to the kernel per call
+const size_t max_iov = 64;
+
+std::unordered_map<int, Connection> connections;
+uint64_t next_connection_id = 1;
+
+// Identical requests in flight run once: later ones just wait for the result,
+// as long as none of it has been sent yet
+std::unordered_map<std::string, std::shared_ptr<Job>> in_flight;
+
+WorkerPool workers;
+std::mutex completed_mutex;
+std::vector<Completion> completed;
+int wake_fd = -1;   // eventfd, signaled by workers when completed is not empty
+
+bool setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+void closeConnection(int epoll_fd, int client_fd)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_fd, nullptr);
+    close(client_fd);
+    connections.erase(client_fd);
+    std::cout << "Client disconnected, " << connections.size() << " connected.\n";
+}
+
+// Sends as much queued output as the socket takes. Returns false if the
+// connection failed. Waits for EPOLLOUT only while output is pending.
+bool flushConnection(int epoll_fd, int client_fd, Connection& conn)
+{
+    while (!conn.out.empty())
     {
-        size_t pos = 0;
-        pos = req.find("&", pos);
+        // a gathered write like writev(), sendmsg() also takes the flags
+        iovec iov[max_iov];
+        size_t count = 0;
+        for (auto it = conn.out.begin(); it != conn.out.end() && count < max_iov; ++it, ++count)
+        {
+            size_t skip = count == 0 ? conn.out_pos : 0;
+            iov[count].iov_base = (void*)(it->data.data() + skip);
+            iov[count].iov_len = it->data.size() - skip;
+        }
 
-        if (pos != std::string::npos) key_value_pairs = 1;
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        // more of this response is on its way: don't push out a short segment
+        int flags = MSG_NOSIGNAL;
+        if (count == conn.out.size() && conn.streaming())
+            flags |= MSG_MORE;
 
-        while (pos != std::string::npos)
+        ssize_t sent = sendmsg(client_fd, &msg, flags);
+        if (sent < 0)
         {
-            key_value_pairs++;
-            pos = req.find("&", pos + 1);
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return false;
+        }
+
+        conn.out_pos += sent;
+        while (!conn.out.empty() && conn.out_pos >= conn.out.front().data.size())
+        {
+            conn.out_pos -= conn.out.front().data.size();
+            conn.out.pop_front();
         }
     }
 
-    req.append("&"); // simplify parsing
+    bool pending = !conn.out.empty();
+    epoll_event ev{};
+    if (conn.closing || conn.backlogged())
+        ev.events = pending ? (uint32_t)EPOLLOUT : 0u;
+    else
+        ev.events = EPOLLIN | EPOLLRDHUP | (pending ? (uint32_t)EPOLLOUT : 0u);
+    ev.data.fd = client_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client_fd, &ev);
+    return true;
+}
 
-    std::size_t pos = req.find("\r\n");
-    if (pos != std::string::npos)
-        req.replace(pos, 2, "");
+// Everything sent and nothing left in the pool for this client
+bool finished(const Connection& conn)
+{
+    return conn.out.empty() && conn.next_response == conn.next_request;
+}
+
+void submitRequest(int client_fd, Connection& conn, const std::string& request)
+{
+    std::cout << "Received: " << request << std::endl;
 
-    for (int i = 0; i < key_value_pairs; i++)
+    Waiter waiter{ client_fd, conn.id, conn.next_request++ };
+    auto it = in_flight.find(request);
+    if (it != in_flight.end())
     {
-        std::string pair = req.substr(0, req.find("&"));
-        req = req.erase(0, req.find("&") + 1);
+        it->second->waiters.push_back(waiter);
+        return;
+    }
+    auto job = std::make_shared<Job>();
+    job->request = request;
+    job->waiters.push_back(waiter);
+    in_flight[request] = job;
 
-        std::string key = pair.substr(0, pair.find("="));
-        std::string value = pair.substr(pair.find("=") + 1);
+    workers.submit([job]
+    {
+        Output out([&job](std::string&& data, bool last)
+        {
+            // counted as unsent while it waits for the I/O thread too
+            job->acquire(data.size());
+            {
+                std::lock_guard<std::mutex> lock(completed_mutex);
+                completed.push_back(Completion{ job, std::move(data), last });
+            }
+            uint64_t one = 1;
+            if (write(wake_fd, &one, sizeof(one)) < 0)
+                std::cerr << "Failed to wake the I/O thread\n";
+            if (!last)
+                job->waitForRoom();
+        });
+        handleRequest(out, job->request);
+        out.finish();
+    });
+}
 
-        pairs.push_back(Pair(key, value));
+// Adds a chunk of response sequence to a connection and moves every response
+// that is next in line to its output. job, if any, produced the chunk.
+void queueChunk(Connection& conn, uint64_t sequence, std::string data, bool last,
+                const std::shared_ptr<Job>& job)
+{
+    PendingResponse& response = conn.done[sequence];
+    if (!data.empty())
+    {
+        // only the response being sent holds the worker back: one queued
+        // behind it may wait on a job that is waiting for this worker
+        bool sending = sequence == conn.next_response;
+        response.chunks.emplace_back(std::move(data), sending ? job : nullptr);
     }
+    response.complete = last;
 
-    if (pairs[0].key != "dev")
+    auto next = conn.done.begin();
+    while (next != conn.done.end() && next->first == conn.next_response)
     {
-        const char* response = "Request must start with dev=<ip>!\n";
-        send(client_fd, response, strlen(response), 0);
-        return;
+        for (Chunk& chunk : next->second.chunks)
+            conn.out.push_back(std::move(chunk));
+        next->second.chunks.clear();
+        if (!next->second.complete)
+            break;
+        conn.next_response++;
+        next = conn.done.erase(next);
     }
-    std::string ip = pairs[0].value;
+}
 
-    if (pairs[1].key == "time")
+// Submits the complete requests in the input buffer, as long as the client
+// isn't backlogged. A request may arrive in pieces or several at once; bytes
+// searched for the end of a line before are not searched again.
+void submitRequests(int client_fd, Connection& conn)
+{
+    size_t start = 0;
+    size_t end;
+    while (!conn.backlogged() && (end = conn.in.find("\r\n", std::max(start, conn.scanned))) != std::string::npos)
+    {
+        // checked here so that garbage never reaches the pool, the worker
+        // parses its own copy again
+        std::string_view line(conn.in.data() + start, end - start);
+        Request request;
+        if (parseRequestLine(line, request))
+            submitRequest(client_fd, conn, std::string(line));
+        else
+            queueChunk(conn, conn.next_request++, malformed_response, true, nullptr);
+        start = end + 2;
+    }
+    conn.in.erase(0, start);
+    conn.scanned = conn.backlogged() || conn.in.empty() ? 0 : conn.in.size() - 1;   // may end with the '\r'
+}
+
+// Hands finished chunks to their connections, in request order
+void deliverCompleted(int epoll_fd)
+{
+    uint64_t count;
+    if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        std::cerr << "Failed to read wake-up counter\n";
+
+    std::vector<Completion> batch;
+    {
+        std::lock_guard<std::mutex> lock(completed_mutex);
+        batch.swap(completed);
+    }
+
+    for (Completion& result : batch)
     {
-        if (pairs[1].value == "days")
+        Job& job = *result.job;
+        if (!job.started)
         {
-            if (pairs.size() <= 2)
-                getDays(client_fd, ip);
-            else if (pairs[2].key == "data")
-                getDataDay(client_fd, ip, pairs[2].value);
-            else
-                sendResponse(client_fd, "400 Invalid request", "Unknown command");
+            // a request arriving from now on would miss the part already sent
+            in_flight.erase(job.request);
+            job.started = true;
         }
-        else if (pairs[1].value == "months")
+
+        size_t size = result.data.size();
+        for (size_t i = 0; i < job.waiters.size(); i++)
         {
-            if (pairs.size() <= 2)
-                getMonths(client_fd, ip);
-            else if (pairs[2].key == "data")
-                getTotalDataMonth(client_fd, ip, pairs[2].value);
-            else
-                sendResponse(client_fd, "400 Invalid request", "Unknown command");
+            const Waiter& waiter = job.waiters[i];
+            auto it = connections.find(waiter.fd);
+            if (it == connections.end() || it->second.id != waiter.connection_id)
+                continue;   // client left, the fd may belong to someone else now
+
+            // the last waiter takes the worker's buffer, the others a copy
+            Connection& conn = it->second;
+            bool last_waiter = i + 1 == job.waiters.size();
+            queueChunk(conn, waiter.sequence, last_waiter ? std::move(result.data) : result.data, result.last,
+                       result.job);
+            if (result.last)
+                submitRequests(waiter.fd, conn);   // requests held back while it was backlogged
+            if (!flushConnection(epoll_fd, waiter.fd, conn) || (conn.closing && finished(conn)))
+                closeConnection(epoll_fd, waiter.fd);
         }
-        else if (pairs[1].value == "years")
+        buffer_pool.give(std::move(result.data), Output::chunk_size);
+        job.release(size);
+    }
+}
+
+// Reads what is available, up to a request's worth more than is buffered,
+// and submits every complete request. Returns false if the client
+// disconnected or misbehaved.
+bool readConnection(int client_fd, Connection& conn)
+{
+    char buffer[4096];
+    bool open = true;
+
+    while (!conn.backlogged() && conn.in.size() < max_request_size)
+    {
+        ssize_t bytes_received = recv(client_fd, buffer, sizeof(buffer), 0);
+        if (bytes_received > 0)
         {
-            if (pairs.size() <= 2)
-                getYears(client_fd, ip);
-            else if (pairs[2].key == "data")
-                getDataYear(client_fd, ip, pairs[2].value);
-            else
-                sendResponse(client_fd, "400 Invalid request", "Unknown command");
+            conn.in.append(buffer, bytes_received);
+            continue;
         }
+        if (bytes_received < 0 && errno == EINTR) continue;
+        if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        // closed by the client: still answer what it already sent
+        open = false;
+        break;
+    }
+
+    submitRequests(client_fd, conn);
+    if (!conn.backlogged() && conn.in.size() >= max_request_size)
+    {
+        std::cerr << "Request too long, dropping client\n";
+        return false;
     }
+    return open;
 }
 
-void handlePOST(int client_fd, std::string req)
+const int compaction_period_s = 600;       // between two compaction passes
+
+// Runs compaction over every device directory in devs/ forever, never
+// faster than bytes_per_s so queries keep most of the disk. Query threads
+// never wait for it: a rewritten file replaces the old one with a rename and
+// readers that had the old one mapped keep it until they are done.
+void runCompaction(size_t bytes_per_s)
 {
-    const char* response = "this is a post req\n";
-    send(client_fd, response, strlen(response), 0);
+    auto pace = [bytes_per_s](size_t bytes)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds((uint64_t)bytes * 1000000 / bytes_per_s));
+    };
+
+    while (true)
+    {
+        std::vector<std::string> ips;
+        if (DIR* d = opendir(storage_dir.c_str()))
+        {
+            while (dirent* entry = readdir(d))
+            {
+                std::string name = entry->d_name;
+                struct stat st;
+                // <ip>.tmp is an import still running
+                if (name[0] != '.' && name.find(".tmp") == std::string::npos &&
+                    stat((storage_dir + name).c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+                    ips.push_back(name);
+            }
+            closedir(d);
+        }
+
+        for (const std::string& ip : ips)
+            if (!compactDevice(ip, pace))
+                std::cerr << "Compaction of " << ip << " did not finish, retrying next pass\n";
+        std::this_thread::sleep_for(std::chrono::seconds(compaction_period_s));
+    }
 }
 
-int main()
+// snse_server [--workers N] [--aggregate-threads N] [--cache-mb N] [--max-gap <seconds>] [--compact-mbs N]
+// Query workers default to one per core, the response cache to 64 MiB.
+// A query that has to aggregate raw samples over months (year totals without
+// rollups, stepped ranges) splits them over up to one thread per core too.
+// Compaction of sealed months is limited to 8 MB/s of segments; 0 turns it off.
+// The max gap only matters for segments whose rollups have to be computed
+// from the raw samples; give it the same value as the getter.
+// recent: the getter's in-memory rows when both run in snse_daemon, or null.
+int runServer(int argc, char* argv[], const RecentSamples* recent)
 {
     const int port = 34678;
-    const int bufferSize = 1024;
-    char buffer[bufferSize];
+    recent_samples = recent;
+    size_t worker_count = std::max(1u, std::thread::hardware_concurrency());
+    int compact_mbs = 8;
+    aggregation_threads = worker_count;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::string(argv[i]) == "--workers" && i + 1 < argc)
+            worker_count = std::max(1, atoi(argv[++i]));
+        else if (std::string(argv[i]) == "--aggregate-threads" && i + 1 < argc)
+            aggregation_threads = std::max(1, atoi(argv[++i]));
+        else if (std::string(argv[i]) == "--cache-mb" && i + 1 < argc)
+            response_cache.setLimit((size_t)std::max(0, atoi(argv[++i])) * 1024 * 1024);
+        else if (std::string(argv[i]) == "--max-gap" && i + 1 < argc)
+            max_energy_gap = std::max(1LL, atoll(argv[++i]));
+        else if (std::string(argv[i]) == "--compact-mbs" && i + 1 < argc)
+            compact_mbs = std::max(0, atoi(argv[++i]));
+    }
 
     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd < 0)
@@ -593,53 +1498,107 @@ int main()
         return 1;
     }
 
-    if (listen(server_fd, 3) < 0)
+    if (listen(server_fd, SOMAXCONN) < 0 || !setNonBlocking(server_fd))
     {
         std::cerr << "Listen failed\n";
         close(server_fd);
         return 1;
     }
 
-    std::cout << "Server listening on port " << port << "...\n";
+    int epoll_fd = epoll_create1(0);
+    wake_fd = eventfd(0, EFD_NONBLOCK);
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = server_fd;
+    epoll_event wake_ev{};
+    wake_ev.events = EPOLLIN;
+    wake_ev.data.fd = wake_fd;
+    if (epoll_fd < 0 || wake_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) < 0 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &wake_ev) < 0)
+    {
+        std::cerr << "epoll setup failed\n";
+        close(server_fd);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    workers.start(worker_count);
+    if (compact_mbs > 0)
+        std::thread(runCompaction, (size_t)compact_mbs * 1000000).detach();
+    std::cout << "Server listening on port " << port << " with " << worker_count << " workers...\n";
+
+    const int max_events = 64;
+    epoll_event events[max_events];
 
     while (true)
     {
-        sockaddr_in client_addr{};
-        socklen_t client_len = sizeof(client_addr);
-        int client_fd = accept(server_fd, (sockaddr*)&client_addr, &client_len);
-        if (client_fd < 0)
+        int ready = epoll_wait(epoll_fd, events, max_events, -1);
+        if (ready < 0)
         {
-            std::cerr << "Accept failed\n";
-            continue;
+            if (errno == EINTR) continue;
+            std::cerr << "epoll_wait failed\n";
+            break;
         }
 
-        while (true)
+        for (int i = 0; i < ready; i++)
         {
-            ssize_t bytes_received = recv(client_fd, buffer, bufferSize - 1, 0);
-            if (bytes_received <= 0) {
-                std::cout << "Client disconnected or error occurred.\n";
-                break;
-            }
-
-            buffer[bytes_received] = '\0';
-            std::string request(buffer);
-            std::cout << "Received: " << request << std::endl;
+            int fd = events[i].data.fd;
 
-            std::string response_type = request.substr(0, request.find(" "));
+            if (fd == wake_fd)
+            {
+                deliverCompleted(epoll_fd);
+                continue;
+            }
 
-            if (response_type == "GET")
-                handleGET(client_fd, request);
-            else if (response_type == "POST")
-                handlePOST(client_fd, request);
-            else
+            if (fd == server_fd)
             {
-                const char* response = "Only POST and GET requests are supported\n";
-                send(client_fd, response, strlen(response), 0);
+                while (true)
+                {
+                    int client_fd = accept4(server_fd, nullptr, nullptr, SOCK_NONBLOCK);
+                    if (client_fd < 0)
+                    {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                            std::cerr << "Accept failed\n";
+                        if (errno == EINTR) continue;
+                        break;
+                    }
+
+                    epoll_event client_ev{};
+                    client_ev.events = EPOLLIN | EPOLLRDHUP;
+                    client_ev.data.fd = client_fd;
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &client_ev) < 0)
+                    {
+                        close(client_fd);
+                        continue;
+                    }
+                    connections[client_fd] = Connection();
+                    connections[client_fd].id = next_connection_id++;
+                }
+                continue;
             }
+
+            auto it = connections.find(fd);
+            if (it == connections.end()) continue;
+            Connection& conn = it->second;
+
+            if (!conn.closing && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)))
+                conn.closing = !readConnection(fd, conn);
+
+            // flush even when the client half-closed, it may still be reading
+            if ((events[i].events & EPOLLERR) || !flushConnection(epoll_fd, fd, conn) ||
+                (conn.closing && finished(conn)))
+                closeConnection(epoll_fd, fd);
         }
-        close(client_fd);
     }
 
+    close(epoll_fd);
     close(server_fd);
     return 0;
-}
\ No newline at end of file
+}
+
+#ifndef SNSE_DAEMON
+int main(int argc, char* argv[])
+{
+    return runServer(argc, argv, nullptr);
+}
+#endif
@@ -0,0 +1,43 @@
+#include <iostream>
+#include <string>
+#include <functional>
+#include <future>
+#include <thread>
+#include <cstdlib>
+
+#include "snse_storage.h"
+
+// Defined in snse_getter.cpp and snse_comm_server.cpp, which leave out their
+// own main() when built with -DSNSE_DAEMON
+int runGetter(int argc, char* argv[], RecentSamples* recent, std::function<void()> on_ready);
+int runServer(int argc, char* argv[], const RecentSamples* recent);
+
+// snse_daemon [getter and server options]: both in one process. The getter
+// hands every row it stores to the server, which answers queries about
+// today and yesterday from memory instead of reading the segments back.
+// snse_daemon getter ... / snse_daemon server ...: just one of them, same as
+// the snse_getter and snse_server binaries.
+int main(int argc, char* argv[])
+{
+    std::string mode = argc > 1 ? argv[1] : "";
+    if (mode == "getter")
+        return runGetter(argc - 1, argv + 1, nullptr, nullptr);
+    if (mode == "server")
+        return runServer(argc - 1, argv + 1, nullptr);
+
+    RecentSamples recent;
+    std::promise<void> ready;
+
+    // the server starts once imports and the ingest log replay are done, so
+    // it never sees half converted devices
+    std::thread getter([&]
+    {
+        int code = runGetter(argc, argv, &recent, [&] { ready.set_value(); });
+        // only one-shot commands (--import, --rebuild-rollups) and errors get here
+        std::exit(code);
+    });
+    getter.detach();
+
+    ready.get_future().wait();
+    return runServer(argc, argv, &recent);
+}
@@ -3,17 +3,35 @@
 #include <sstream>
 #include <vector>
 #include <string>
+#include <unordered_map>
 #include <cstring>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <cerrno>
 #include <ctime>
 #include <iomanip>
 #include <thread>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#include <functional>
 
-const int minute_interval = 5;
+#include "snse_storage.h"
+
+const int default_interval = 300;          // seconds between samples, --interval to change it
 const int server_port = 34677;
 const char* request = "GET ?features\r\n";
 const int buf_size = 4096;
+const size_t max_response_size = 16 * 1024;
+const int64_t connect_timeout_ms = 3000;
+const int64_t read_timeout_ms = 5000;
+const int64_t round_timeout_ms = 30000;     // cut to 90% of the interval if that is shorter
+const size_t max_parallel_polls = 512;
+const int64_t reconnect_backoff_ms = 10000;
+const int64_t max_reconnect_backoff_ms = 30 * 60 * 1000;
+const size_t log_checkpoint_size = 1024 * 1024;  // ingest log bytes before the segments are synced
+const int retention_period_s = 3600;        // between two retention passes
 
 // Loads a plain list of IPs, one per line:
 //   xxx.xxx.xxx.xxx
@@ -34,54 +52,289 @@ std::vector<std::string> loadDevices(const std::string& filename) {
     return ips;
 }
 
-std::string getCurrentDateTime() {
-    std::time_t now = std::time(nullptr);
-    std::tm* localTime = std::localtime(&now);
-    std::ostringstream oss;
-    oss << std::put_time(localTime, "%d/%m/%Y;%H:%M");
-    return oss.str();
+// Connection to one device, kept open from one round to the next so the
+// board doesn't go through a CONNECT/CLOSED exchange for every sample
+struct DeviceLink {
+    int fd = -1;
+    int failures = 0;            // consecutive failed polls
+    int64_t retry_ms = 0;        // no new connection before this (backoff)
+};
+
+// One device being polled in the current round
+struct DevicePoll {
+    std::string ip;
+    DeviceLink* link = nullptr;
+    bool reused = false;         // the connection comes from an earlier round
+    bool sent = false;
+    bool done = false;
+    int64_t deadline_ms = 0;     // connect deadline, then read deadline once the request is sent
+    std::string response;
+};
+
+int64_t nowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void closeLink(DeviceLink& link) {
+    if (link.fd >= 0) {
+        close(link.fd);
+        link.fd = -1;
+    }
+}
+
+// A failed poll drops the connection and backs off: 10 s, 20 s, 40 s... up to 30 min
+void finishPoll(int epoll_fd, DevicePoll& poll, const char* error) {
+    DeviceLink& link = *poll.link;
+    if (link.fd >= 0)
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, link.fd, nullptr);
+
+    if (error != nullptr) {
+        std::cerr << poll.ip << ": " << error << "\n";
+        poll.response.clear();
+        closeLink(link);
+        link.failures++;
+        int64_t backoff_ms = reconnect_backoff_ms << std::min(link.failures - 1, 20);
+        link.retry_ms = nowMs() + std::min(backoff_ms, max_reconnect_backoff_ms);
+    } else {
+        link.failures = 0;
+    }
+    poll.done = true;
+}
+
+bool watchPoll(int epoll_fd, DevicePoll& poll, size_t slot, uint32_t events, int op) {
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.u64 = slot;
+    return epoll_ctl(epoll_fd, op, poll.link->fd, &ev) == 0;
 }
 
-std::string getResponse(const std::string& dev_ip) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        std::cerr << "Error creating socket\n";
-        return "";
+// Sends the request on an established connection and waits for the answer
+void sendPollRequest(int epoll_fd, DevicePoll& poll, size_t slot, int op) {
+    // the request is tiny, it always fits in an empty socket buffer
+    if (send(poll.link->fd, request, strlen(request), MSG_NOSIGNAL) != (ssize_t)strlen(request) ||
+        !watchPoll(epoll_fd, poll, slot, EPOLLIN | EPOLLRDHUP, op)) {
+        finishPoll(epoll_fd, poll, "Send failed");
+        return;
     }
+    poll.sent = true;
+    poll.deadline_ms = nowMs() + read_timeout_ms;
+}
 
+// Starts a non-blocking connect. Returns false if the device can't be reached at all.
+bool connectPoll(int epoll_fd, DevicePoll& poll, size_t slot) {
     sockaddr_in server_addr{};
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(server_port);
-    if (inet_pton(AF_INET, dev_ip.c_str(), &server_addr.sin_addr) <= 0) {
-        std::cerr << "Invalid address or address not supported\n";
-        close(sock);
-        return "";
+    if (inet_pton(AF_INET, poll.ip.c_str(), &server_addr.sin_addr) <= 0) {
+        finishPoll(epoll_fd, poll, "Invalid address or address not supported");
+        return false;
+    }
+
+    poll.reused = false;
+    poll.link->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (poll.link->fd < 0) {
+        finishPoll(epoll_fd, poll, "Error creating socket");
+        return false;
+    }
+
+    if ((connect(poll.link->fd, (sockaddr*)&server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS) ||
+        !watchPoll(epoll_fd, poll, slot, EPOLLOUT, EPOLL_CTL_ADD)) {
+        finishPoll(epoll_fd, poll, "Connection failed");
+        return false;
+    }
+    poll.deadline_ms = nowMs() + connect_timeout_ms;
+    return true;
+}
+
+// The board closes links that stay idle too long (AT+CIPSTO), so a kept
+// connection may be dead by the next round. Returns false if it is.
+bool linkAlive(DeviceLink& link) {
+    char buffer[buf_size];
+    while (true) {
+        ssize_t got = recv(link.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (got > 0) continue;  // nothing is expected between rounds, drop it
+        if (got < 0 && errno == EINTR) continue;
+        return got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+}
+
+// Reuses the device connection if it is still up, otherwise opens a new one.
+// Returns false if the device is skipped or failed right away.
+bool startPoll(int epoll_fd, DevicePoll& poll, size_t slot) {
+    DeviceLink& link = *poll.link;
+    if (link.fd >= 0 && !linkAlive(link))
+        closeLink(link);
+
+    if (link.fd >= 0) {
+        poll.reused = true;
+        sendPollRequest(epoll_fd, poll, slot, EPOLL_CTL_ADD);
+        return !poll.done;
     }
 
-    if (connect(sock, (sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        std::cerr << "Connection failed\n";
-        close(sock);
-        return "";
+    if (nowMs() < link.retry_ms) {
+        std::cerr << poll.ip << ": unreachable, next attempt in "
+                  << (link.retry_ms - nowMs()) / 1000 << " s\n";
+        poll.done = true;
+        return false;
     }
+    return connectPoll(epoll_fd, poll, slot);
+}
 
-    if (send(sock, request, strlen(request), 0) < 0) {
-        std::cerr << "Send failed\n";
-        close(sock);
-        return "";
+// Connect finished (or failed): send the request
+void connectedPoll(int epoll_fd, DevicePoll& poll, size_t slot) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(poll.link->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+        finishPoll(epoll_fd, poll, "Connection failed");
+        return;
     }
+    sendPollRequest(epoll_fd, poll, slot, EPOLL_CTL_MOD);
+}
 
+// Devices answer "200 OK\n<features>\r\n" and keep the connection open
+void readPollResponse(int epoll_fd, DevicePoll& poll, size_t slot) {
     char buffer[buf_size];
-    ssize_t bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0);
-    if (bytes_received < 0) {
-        std::cerr << "Receive failed\n";
-        close(sock);
-        return "";
+    while (true) {
+        ssize_t bytes_received = recv(poll.link->fd, buffer, sizeof(buffer), 0);
+        if (bytes_received > 0) {
+            poll.response.append(buffer, bytes_received);
+            if (poll.response.find("\r\n") != std::string::npos) {
+                finishPoll(epoll_fd, poll, nullptr);
+                return;
+            }
+            if (poll.response.size() > max_response_size) {
+                finishPoll(epoll_fd, poll, "Response too long");
+                return;
+            }
+            continue;
+        }
+        if (bytes_received < 0 && errno == EINTR) continue;
+        if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+        // closed by the device
+        if (!poll.response.empty()) {
+            finishPoll(epoll_fd, poll, nullptr);
+            closeLink(*poll.link);
+        } else if (poll.reused) {
+            // the kept connection died under us, this is not a device failure
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, poll.link->fd, nullptr);
+            closeLink(*poll.link);
+            poll.sent = false;
+            connectPoll(epoll_fd, poll, slot);
+        } else {
+            finishPoll(epoll_fd, poll, "Receive failed");
+        }
+        return;
+    }
+}
+
+// Polls every device at once over its kept connection, or a new one. Each
+// device gets connect_timeout_ms to accept a connection and read_timeout_ms
+// to answer, and whatever is still pending after round_ms is given up.
+// Devices that failed come back with an empty response.
+std::vector<DevicePoll> pollDevices(const std::vector<std::string>& ips,
+                                    std::unordered_map<std::string, DeviceLink>& links, int64_t round_ms) {
+    std::vector<DevicePoll> polls(ips.size());
+    for (size_t i = 0; i < ips.size(); ++i) {
+        polls[i].ip = ips[i];
+        polls[i].link = &links[ips[i]];
+    }
+
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        std::cerr << "epoll setup failed\n";
+        return polls;
+    }
+
+    int64_t round_deadline_ms = nowMs() + round_ms;
+    size_t next = 0;
+    size_t active = 0;
+    std::vector<epoll_event> events(max_parallel_polls);
+
+    while (true) {
+        // keep at most max_parallel_polls polls going
+        while (next < polls.size() && active < max_parallel_polls) {
+            if (startPoll(epoll_fd, polls[next], next))
+                active++;
+            next++;
+        }
+        if (active == 0) break;
+
+        int64_t now_ms = nowMs();
+        if (now_ms >= round_deadline_ms) break;
+
+        // sleep until the nearest deadline at most
+        int64_t wake_ms = round_deadline_ms;
+        for (const DevicePoll& poll : polls) {
+            if (!poll.done && poll.deadline_ms > 0)
+                wake_ms = std::min(wake_ms, poll.deadline_ms);
+        }
+
+        int ready = epoll_wait(epoll_fd, events.data(), (int)events.size(), (int)std::max<int64_t>(0, wake_ms - now_ms));
+        if (ready < 0 && errno != EINTR) {
+            std::cerr << "epoll_wait failed\n";
+            break;
+        }
+
+        for (int i = 0; i < ready; ++i) {
+            size_t slot = events[i].data.u64;
+            DevicePoll& poll = polls[slot];
+            if (poll.done) continue;
+            if (!poll.sent)
+                connectedPoll(epoll_fd, poll, slot);
+            else
+                readPollResponse(epoll_fd, poll, slot);
+            if (poll.done)
+                active--;
+        }
+
+        now_ms = nowMs();
+        for (size_t slot = 0; slot < next; ++slot) {
+            DevicePoll& poll = polls[slot];
+            if (!poll.done && now_ms >= poll.deadline_ms) {
+                // a late answer would be read as the next one: drop the connection
+                finishPoll(epoll_fd, poll, poll.sent ? "Read timed out" : "Connection timed out");
+                active--;
+            }
+        }
+    }
+
+    for (DevicePoll& poll : polls) {
+        if (!poll.done)
+            finishPoll(epoll_fd, poll, "Round deadline passed");
     }
+    close(epoll_fd);
 
-    buffer[bytes_received] = '\0';
-    std::string response(buffer);
-    close(sock);
-    return response;
+    // forget devices that left devs_list.txt
+    for (auto it = links.begin(); it != links.end(); ) {
+        if (std::find(ips.begin(), ips.end(), it->first) == ips.end()) {
+            closeLink(it->second);
+            it = links.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    return polls;
+}
+
+// Stores a sample through the device's writer, which stays open from one round
+// to the next. A writer that failed is dropped; opening it again next time
+// repairs whatever the failed append left behind. replay: the sample comes
+// from the ingest log and may already be stored. Stored rows also go to the
+// recent samples of snse_daemon's server, if there is one.
+bool storeSample(std::unordered_map<std::string, DeviceWriter>& writers, const DeviceSample& sample, bool replay,
+                 RecentSamples* recent) {
+    DeviceWriter& writer = writers[sample.ip];
+    bool stored = writer.isOpen() || writer.open(deviceDir(sample.ip));
+    if (stored && !(replay && sample.timestamp <= writer.lastTimestamp())) {
+        stored = writer.append(sample.timestamp, sample.labels, sample.values);
+        if (stored && recent)
+            recent->add(sample.ip, writer.lastTimestamp(), writer.labels(), writer.lastRow());
+    }
+    if (!stored)
+        writers.erase(sample.ip);
+    return stored;
 }
 
 // Counts how many sensors are marked with $graph_ in the response.
@@ -97,74 +350,183 @@ int countGraphedSensors(const std::string& raw_response) {
     return count;
 }
 
-std::string getDataString(const std::string& raw_response) {
-    std::string save_string = getCurrentDateTime() + ";";
-    size_t pos = -1;
+// Extracts the graphed sensors from a features response.
+// "sensor1$Power$81.75 W$graph_W_Wh;" gives label "graph_W_Wh" and value 81.75:
+// the value is the field before the graph marker. Sensors without a graph
+// marker are skipped. One pass over the response, no copies until the label.
+void getGraphedValues(const std::string& raw_response,
+                      std::vector<std::string>& labels, std::vector<float>& values) {
+    labels.clear();
+    values.clear();
 
-    while (true) {
-        // find next sensor block: skip sensor name ($), skip label ($)
-        size_t name_dollar = raw_response.find("$", pos + 1);
-        if (name_dollar == std::string::npos) break;
+    std::vector<std::string_view> sensors;
+    splitFields(raw_response, ';', sensors);
 
-        size_t label_dollar = raw_response.find("$", name_dollar + 1);
-        if (label_dollar == std::string::npos) break;
+    for (std::string_view sensor : sensors) {
+        size_t marker = sensor.find("$graph_");
+        if (marker == std::string_view::npos || marker == 0) continue;
 
-        // value runs from after label_dollar to the next $ or ;
-        size_t next_dollar = raw_response.find("$", label_dollar + 1);
-        size_t next_semi   = raw_response.find(";", label_dollar + 1);
+        size_t value_start = sensor.rfind('$', marker - 1);
+        if (value_start == std::string_view::npos) continue;
 
-        if (next_semi == std::string::npos) break;
+        labels.push_back(std::string(sensor.substr(marker + 1)));
+        values.push_back(parseFloat(sensor.substr(value_start + 1, marker - value_start - 1)));
+    }
+}
 
-        if (next_dollar != std::string::npos && next_dollar < next_semi) {
-            // graphed sensor: value$graph_W_Wh;
-            std::string value      = raw_response.substr(label_dollar + 1, next_dollar - label_dollar - 1);
-            std::string graph_label = raw_response.substr(next_dollar + 1, next_semi - next_dollar - 1);
+// The getter, on its own or inside snse_daemon. recent: where stored rows are
+// kept for the server, null if there is no server in this process. on_ready
+// is called once imports and the log replay are done and sampling starts.
+int runGetter(int argc, char* argv[], RecentSamples* recent, std::function<void()> on_ready) {
+    int interval = default_interval;
+    int64_t max_gap = -1;
+    bool sync_rounds = true;
+    RetentionPolicy retention;
+    std::unordered_map<std::string, DeviceLink> links;
+    std::unordered_map<std::string, DeviceWriter> writers;
+
+    // options come first:
+    //   --interval <seconds>: sample every 1 s up to once a day
+    //   --max-gap <seconds>: longer holes between samples add no energy,
+    //                        defaults to 15 min or three intervals if longer
+    //   --durability round|none: sync the ingest log after every round
+    //                            (default) or leave it to the OS
+    //   --keep-raw-days <days>: replace older months by hourly aggregates
+    //   --keep-hourly-months <months>: then keep only daily and monthly totals
+    // other options belong to the server when both run in snse_daemon
+    int arg = 1;
+    while (arg + 1 < argc) {
+        std::string option = argv[arg];
+        if (option == "--import" || option == "--rebuild-rollups" || option == "--compress")
+            break;
+        if (option == "--interval")
+            interval = atoi(argv[arg + 1]);
+        else if (option == "--max-gap")
+            max_gap = atoll(argv[arg + 1]);
+        else if (option == "--durability")
+            sync_rounds = std::string(argv[arg + 1]) != "none";
+        else if (option == "--keep-raw-days")
+            retention.raw_days = std::max(0, atoi(argv[arg + 1]));
+        else if (option == "--keep-hourly-months")
+            retention.hourly_months = std::max(0, atoi(argv[arg + 1]));
+        arg += 2;
+    }
 
-            // strip unit from value if present (e.g. "81.75 W" -> "81.75")
-            std::string numeric = value.substr(0, value.find(" "));
-            save_string += numeric + ":" + graph_label + ";";
-            pos = next_semi;
-        } else {
-            // non-graphed sensor: skip entirely
-            pos = next_semi;
+    if (interval < 1 || interval > 86400) {
+        std::cerr << "The interval must be between 1 and 86400 seconds\n";
+        return 1;
+    }
+    max_energy_gap = max_gap > 0 ? max_gap : std::max<int64_t>(default_max_energy_gap, 3 * interval);
+
+    // snse_getter --import <ip>...: convert old devs/<ip>.txt logs and exit
+    if (arg < argc && std::string(argv[arg]) == "--import") {
+        for (int i = arg + 1; i < argc; ++i) {
+            long rows = importTextLog(argv[i]);
+            if (rows < 0)
+                std::cerr << "Import of " << textLogPath(argv[i]) << " failed\n";
+            else
+                std::cout << "Imported " << rows << " samples into " << deviceDir(argv[i]) << std::endl;
         }
-
-        // stop if we've passed the end of the sensor list
-        if (pos == std::string::npos || pos >= raw_response.size()) break;
+        return 0;
     }
 
-    return save_string;
-}
+    // snse_getter --rebuild-rollups <ip>...: regenerate month/day rollups from
+    // the raw samples and exit. Stop the running getter first.
+    if (arg < argc && std::string(argv[arg]) == "--rebuild-rollups") {
+        for (int i = arg + 1; i < argc; ++i) {
+            if (rebuildRollups(argv[i]))
+                std::cout << "Rebuilt rollups for " << argv[i] << std::endl;
+            else
+                std::cerr << "No history found for " << argv[i] << "\n";
+        }
+        return 0;
+    }
 
-int main() {
-    int last_checked_minute = -1;
+    // snse_getter --compress <ip>...: compress the months stored before
+    // compression existed and exit; new months are compressed as they end
+    if (arg < argc && std::string(argv[arg]) == "--compress") {
+        for (int i = arg + 1; i < argc; ++i) {
+            long segments = compressHistory(argv[i]);
+            if (segments < 0)
+                std::cerr << "No history found for " << argv[i] << "\n";
+            else
+                std::cout << "Compressed " << segments << " months of " << argv[i] << std::endl;
+        }
+        return 0;
+    }
 
-    while (true) {
-        auto now = std::chrono::system_clock::now();
-        std::time_t now_c = std::chrono::system_clock::to_time_t(now);
-        std::tm* ltm = std::localtime(&now_c);
+    // devices that still only have a text log are converted on first start
+    for (const std::string& ip : loadDevices("devs_list.txt"))
+        importIfNeeded(ip);
+
+    // samples of the last rounds before a crash may be missing from the segments
+    IngestLog ingest_log;
+    if (!ingest_log.open(storage_dir + "ingest.wal", sync_rounds))
+        return 1;
+    std::vector<DeviceSample> logged = ingest_log.pending();
+    for (const DeviceSample& sample : logged)
+        storeSample(writers, sample, true, recent);
+    if (!logged.empty())
+        std::cout << "Checked " << logged.size() << " samples of the ingest log" << std::endl;
+    ingest_log.checkpoint();
+
+    // two days of rows per device, plus a few for rounds that came late
+    if (recent)
+        recent->setCapacity(2 * 86400 / interval + 16);
+
+    // retention only rewrites sealed months and swaps files with renames, so
+    // it runs beside the rounds and nothing waits for it
+    if (retention.raw_days > 0 || retention.hourly_months > 0) {
+        std::thread([retention] {
+            while (true) {
+                for (const std::string& ip : loadDevices("devs_list.txt"))
+                    applyRetention(ip, retention, std::time(nullptr));
+                std::this_thread::sleep_for(std::chrono::seconds(retention_period_s));
+            }
+        }).detach();
+    }
+    if (on_ready)
+        on_ready();
 
-        std::cout << "\nChecking now: " << std::put_time(ltm, "%d/%m/%Y %H:%M:%S") << std::endl;
+    int64_t round_ms = std::min<int64_t>(round_timeout_ms, interval * 900);
+    std::time_t last_slot = 0;
+    std::cout << "Sampling every " << interval << " s" << std::endl;
 
-        int current_minute = ltm->tm_min;
+    while (true) {
+        // rounds start on multiples of the interval counted from local midnight,
+        // so a 300 s interval samples at hh:00, hh:05, ... like it always did
+        std::time_t now = std::max(std::time(nullptr), last_slot + 1);
+        std::tm today = localTm(now);
+        std::time_t midnight = makeLocalTime(today.tm_year + 1900, today.tm_mon + 1, today.tm_mday);
+        std::time_t slot = midnight + (now - midnight + interval - 1) / interval * interval;
+        std::time_t next_midnight = nextPeriodStart(now, PERIOD_DAY);
+        if (slot > next_midnight)
+            slot = next_midnight;
 
-        if (current_minute % minute_interval != 0 || current_minute == last_checked_minute) {
-            auto next_minute = std::chrono::time_point_cast<std::chrono::minutes>(now) + std::chrono::minutes(1);
-            std::this_thread::sleep_until(next_minute);
-            continue;
-        }
+        std::this_thread::sleep_until(std::chrono::system_clock::from_time_t(slot));
+        last_slot = slot;
 
-        last_checked_minute = current_minute;
+        std::cout << "\nChecking now: " << formatDate(slot) << " " << formatTime(slot) << std::endl;
 
         // reload device list at every update
         std::vector<std::string> ips = loadDevices("devs_list.txt");
 
-        for (size_t dev_i = 0; dev_i < ips.size(); ++dev_i) {
-            const std::string& sensor_device_ip = ips[dev_i];
+        std::vector<DevicePoll> polls = pollDevices(ips, links, round_ms);
+        std::vector<DeviceSample> samples;
 
-            std::cout << "Processing device: " << sensor_device_ip << " i: " << dev_i << std::endl;
+        // close the files of devices that left devs_list.txt
+        for (auto it = writers.begin(); it != writers.end(); ) {
+            if (std::find(ips.begin(), ips.end(), it->first) == ips.end())
+                it = writers.erase(it);
+            else
+                ++it;
+        }
 
-            std::string response = getResponse(sensor_device_ip);
+        for (size_t dev_i = 0; dev_i < polls.size(); ++dev_i) {
+            const std::string& sensor_device_ip = polls[dev_i].ip;
+            const std::string& response = polls[dev_i].response;
+
+            std::cout << "Processing device: " << sensor_device_ip << " i: " << dev_i << std::endl;
             std::cout << "response: " << response << std::endl;
 
             if (response.empty()) {
@@ -184,21 +546,43 @@ int main() {
                 continue;
             }
 
-            std::string save_string = getDataString(response);
-            std::cout << save_string << std::endl;
-
-            std::ofstream outFile("devs/" + sensor_device_ip + ".txt", std::ios::app);
-            std::cout << "attempting write to devs/" << sensor_device_ip << ".txt..." << std::endl;
+            DeviceSample sample;
+            sample.ip = sensor_device_ip;
+            getGraphedValues(response, sample.labels, sample.values);
+
+            // every device of a round gets the round's time, rows line up across devices
+            sample.timestamp = slot;
+            std::cout << formatDate(slot) << ";" << formatTime(slot) << ";";
+            for (size_t i = 0; i < sample.labels.size(); ++i)
+                std::cout << sample.values[i] << ":" << sample.labels[i] << ";";
+            std::cout << std::endl;
+            samples.push_back(std::move(sample));
+        }
 
-            if (outFile.is_open()) {
-                std::cout << "writing to file devs/" << sensor_device_ip << ".txt" << std::endl;
-                outFile << save_string << std::endl;
-                outFile.close();
-            } else {
-                std::cerr << "Failed to open file for " << sensor_device_ip << ".\n";
-            }
+        // group commit: one log write and one sync for the whole round, then
+        // the segments, which are only synced when the log is emptied
+        if (samples.empty())
+            continue;
+        // the segments are only synced at checkpoints, a round the log doesn't
+        // hold isn't crash safe: try once more, then leave it out and say so
+        if (!ingest_log.commit(samples) && !ingest_log.commit(samples)) {
+            std::cerr << "Dropping the samples of this round, the ingest log cannot be written.\n";
+            continue;
+        }
+        for (const DeviceSample& sample : samples) {
+            std::cout << "writing to " << deviceDir(sample.ip) << std::endl;
+            if (!storeSample(writers, sample, false, recent))
+                std::cerr << "Failed to save sample for " << sample.ip << ".\n";
         }
+        if (ingest_log.size() > log_checkpoint_size)
+            ingest_log.checkpoint();
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+#ifndef SNSE_DAEMON
+int main(int argc, char* argv[]) {
+    return runGetter(argc, argv, nullptr, nullptr);
+}
+#endif
@@ -0,0 +1,2934 @@
+#include "snse_storage.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <charconv>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <cerrno>
+#include <climits>
+#include <map>
+#include <atomic>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SNSE_X86 1
+#endif
+
+static const char storage_magic[4] = { 'S', 'N', 'S', 'E' };
+static const char compressed_magic[4] = { 'S', 'N', 'S', 'Z' };
+static const char hourly_magic[4] = { 'S', 'N', 'S', 'H' };
+static const size_t compressed_block_rows = 1024;
+static const size_t block_entry_size = 16;     // i64 first timestamp, u64 offset
+static const char index_magic[4] = { 'S', 'N', 'S', 'I' };
+static const char rollup_magic[4] = { 'S', 'N', 'S', 'R' };
+static const char periods_magic[4] = { 'S', 'N', 'S', 'P' };
+static const size_t periods_header_size = 8;
+static const size_t index_header_size = 8;
+static const size_t index_entry_size = 64;     // i64 first, i64 last, u64 rows, 40 byte name
+static const size_t index_name_size = 40;
+static const char log_magic[4] = { 'S', 'N', 'S', 'W' };
+static const uint32_t log_version = 1;
+static const size_t log_header_size = 8;
+static const size_t log_record_header_size = 8;   // u32 payload size, u32 hash
+static const size_t import_chunk_size = 1 << 20;   // text log bytes scanned for delimiters at once
+static const uint64_t min_parallel_rows = 1 << 18;  // raw rows worth another aggregation thread
+
+int64_t max_energy_gap = default_max_energy_gap;
+unsigned aggregation_threads = 1;
+
+std::string deviceDir(const std::string& ip)
+{
+    return storage_dir + ip + "/";
+}
+
+std::string textLogPath(const std::string& ip)
+{
+    return storage_dir + ip + ".txt";
+}
+
+// Single-file store written before history was split in segments
+static std::string legacyStorePath(const std::string& ip)
+{
+    return storage_dir + ip + ".snse";
+}
+
+std::string segmentName(int64_t ts)
+{
+    std::tm t = localTm(ts);
+    char buf[40];
+    snprintf(buf, sizeof(buf), "%04d-%02d.snse", t.tm_year + 1900, t.tm_mon + 1);
+    return buf;
+}
+
+static bool readExact(int fd, void* buf, size_t len, off_t offset)
+{
+    char* p = (char*)buf;
+    while (len > 0)
+    {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static bool writeAll(int fd, const void* buf, size_t len)
+{
+    const char* p = (const char*)buf;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool pwriteAll(int fd, const void* buf, size_t len, off_t offset)
+{
+    const char* p = (const char*)buf;
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// Where the next version of path is written before it is renamed over it.
+// Unique per call, so threads and processes rewriting the same file at the
+// same time each have their own.
+static std::string tempPath(const std::string& path)
+{
+    static std::atomic<unsigned> counter{0};
+    return path + "." + std::to_string(getpid()) + "-" + std::to_string(counter++) + ".tmp";
+}
+
+static void removeDir(const std::string& dir)
+{
+    DIR* d = opendir(dir.c_str());
+    if (d == nullptr) return;
+    while (dirent* entry = readdir(d))
+    {
+        std::string name = entry->d_name;
+        if (name != "." && name != "..")
+            unlink((dir + name).c_str());
+    }
+    closedir(d);
+    rmdir(dir.c_str());
+}
+
+// Reads the header of an open segment or rollup file. Fills labels and header size.
+static bool readHeader(int fd, std::vector<std::string>& labels, size_t& header_size,
+                       const char* magic = storage_magic, uint32_t expected_version = storage_version)
+{
+    char fixed[16];
+    if (!readExact(fd, fixed, sizeof(fixed), 0)) return false;
+    if (memcmp(fixed, magic, 4) != 0) return false;
+
+    uint32_t version, sensors, size;
+    memcpy(&version, fixed + 4, 4);
+    memcpy(&sensors, fixed + 8, 4);
+    memcpy(&size, fixed + 12, 4);
+    if (version != expected_version || size < sizeof(fixed)) return false;
+
+    std::vector<char> rest(size - sizeof(fixed));
+    if (!rest.empty() && !readExact(fd, rest.data(), rest.size(), sizeof(fixed))) return false;
+
+    labels.clear();
+    size_t pos = 0;
+    for (uint32_t i = 0; i < sensors; i++)
+    {
+        uint16_t len;
+        if (pos + 2 > rest.size()) return false;
+        memcpy(&len, rest.data() + pos, 2);
+        pos += 2;
+        if (pos + len > rest.size()) return false;
+        labels.push_back(std::string(rest.data() + pos, len));
+        pos += len;
+    }
+
+    header_size = size;
+    return true;
+}
+
+static std::string buildHeader(const std::vector<std::string>& labels,
+                               const char* magic = storage_magic, uint32_t version = storage_version)
+{
+    std::string header(magic, 4);
+    uint32_t sensors = labels.size();
+    uint32_t size = 16;
+    for (const std::string& label : labels)
+        size += 2 + label.size();
+
+    header.append((const char*)&version, 4);
+    header.append((const char*)&sensors, 4);
+    header.append((const char*)&size, 4);
+    for (const std::string& label : labels)
+    {
+        uint16_t len = label.size();
+        header.append((const char*)&len, 2);
+        header += label;
+    }
+    return header;
+}
+
+static void encodeRecord(std::string& out, int64_t timestamp, const float* values, size_t sensors)
+{
+    out.append((const char*)&timestamp, sizeof(timestamp));
+    out.append((const char*)values, sensors * sizeof(float));
+}
+
+static void encodeIndexEntry(char* out, const SegmentInfo& info)
+{
+    memset(out, 0, index_entry_size);
+    memcpy(out, &info.first_ts, 8);
+    memcpy(out + 8, &info.last_ts, 8);
+    memcpy(out + 16, &info.rows, 8);
+    memcpy(out + 24, info.name.data(), std::min(info.name.size(), index_name_size - 1));
+}
+
+static size_t rollupEntrySize(size_t sensors)
+{
+    return 16 + sensors * 32;
+}
+
+static void encodeRollup(std::string& out, const Rollup& rollup)
+{
+    uint32_t reserved = 0;
+    uint32_t max_gap = max_energy_gap;
+    out.append((const char*)&rollup.start, 8);
+    out.append((const char*)&rollup.samples, 4);
+    out.append((const char*)&max_gap, 4);
+    for (const SensorRollup& sensor : rollup.sensors)
+    {
+        out.append((const char*)&sensor.sum, 8);
+        out.append((const char*)&sensor.energy, 8);
+        out.append((const char*)&sensor.min, 4);
+        out.append((const char*)&sensor.max, 4);
+        out.append((const char*)&sensor.count, 4);
+        out.append((const char*)&reserved, 4);
+    }
+}
+
+static void decodeRollup(const char* in, size_t sensors, Rollup& rollup)
+{
+    memcpy(&rollup.start, in, 8);
+    memcpy(&rollup.samples, in + 8, 4);
+    rollup.sensors.resize(sensors);
+    for (size_t i = 0; i < sensors; i++)
+    {
+        const char* p = in + 16 + i * 32;
+        SensorRollup& sensor = rollup.sensors[i];
+        memcpy(&sensor.sum, p, 8);
+        memcpy(&sensor.energy, p + 8, 8);
+        memcpy(&sensor.min, p + 16, 4);
+        memcpy(&sensor.max, p + 20, 4);
+        memcpy(&sensor.count, p + 24, 4);
+    }
+}
+
+void Rollup::add(const float* values, const double* areas)
+{
+    samples++;
+    for (size_t i = 0; i < sensors.size(); i++)
+    {
+        float value = values[i];
+        if (std::isnan(value)) continue;
+
+        SensorRollup& sensor = sensors[i];
+        sensor.sum += value;
+        sensor.energy += areas[i];
+        if (sensor.count == 0 || value < sensor.min) sensor.min = value;
+        if (sensor.count == 0 || value > sensor.max) sensor.max = value;
+        sensor.count++;
+    }
+}
+
+void Rollup::merge(const Rollup& other)
+{
+    samples += other.samples;
+    for (size_t i = 0; i < sensors.size() && i < other.sensors.size(); i++)
+    {
+        const SensorRollup& from = other.sensors[i];
+        if (from.count == 0) continue;
+
+        SensorRollup& sensor = sensors[i];
+        sensor.sum += from.sum;
+        sensor.energy += from.energy;
+        if (sensor.count == 0 || from.min < sensor.min) sensor.min = from.min;
+        if (sensor.count == 0 || from.max > sensor.max) sensor.max = from.max;
+        sensor.count += from.count;
+    }
+}
+
+// No branches in the loop, so it vectorizes over the sensors of the row
+void integrateInterval(const float* prev, const float* values, size_t sensors, int64_t dt, double* areas)
+{
+    double half_hours = dt > 0 && dt <= max_energy_gap ? dt / 7200.0 : 0.0;
+    for (size_t i = 0; i < sensors; i++)
+    {
+        double area = ((double)prev[i] + values[i]) * half_hours;
+        areas[i] = area == area ? area : 0.0;   // NaN on either side
+    }
+}
+
+// Moves row from the columns in from onto the ones in to, NaN where missing
+static std::vector<float> remapRow(const std::vector<std::string>& from, const std::vector<float>& row,
+                                   const std::vector<std::string>& to)
+{
+    std::vector<float> result(to.size(), NAN);
+    for (size_t i = 0; i < to.size(); i++)
+    {
+        for (size_t col = 0; col < from.size() && col < row.size(); col++)
+        {
+            if (from[col] == to[i])
+            {
+                result[i] = row[col];
+                break;
+            }
+        }
+    }
+    return result;
+}
+
+// Last sample of a segment file, with its values moved onto labels
+static bool readLastRow(const std::string& path, const std::vector<std::string>& labels,
+                        int64_t& ts, std::vector<float>& values)
+{
+    Segment segment;
+    SampleBlock block;
+    if (!segment.open(path) || segment.rowCount() == 0 || segment.read(segment.rowCount() - 1, 1, block) != 1)
+        return false;
+
+    ts = block.timestamps[0];
+    values = remapRow(segment.labels, block.values, labels);
+    return true;
+}
+
+std::string rollupName(const std::string& segment_name)
+{
+    return segment_name.substr(0, segment_name.find('.')) + ".roll";
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(const std::string& path)
+{
+    close();
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    remap();
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (map != nullptr)
+        munmap(map, length);
+    if (fd >= 0)
+        ::close(fd);
+    map = nullptr;
+    length = 0;
+    fd = -1;
+}
+
+bool MappedFile::remap()
+{
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size <= length)
+        return false;
+
+    void* grown = map == nullptr
+        ? mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0)
+        : mremap(map, length, st.st_size, MREMAP_MAYMOVE);
+    if (grown == MAP_FAILED)
+        return false;
+
+    map = (char*)grown;
+    length = st.st_size;
+    return true;
+}
+
+// Most significant bit first, as in the Gorilla paper
+class BitWriter
+{
+public:
+    explicit BitWriter(std::string& out) : out(out) {}
+
+    void write(uint64_t value, int bits)
+    {
+        if (bits > 32)
+        {
+            write(value >> 32, bits - 32);
+            bits = 32;
+        }
+        acc = (acc << bits) | (value & ((1ULL << bits) - 1));
+        count += bits;
+        while (count >= 8)
+        {
+            count -= 8;
+            out.push_back((char)(acc >> count));
+        }
+    }
+
+    void finish()
+    {
+        if (count > 0)
+            out.push_back((char)(acc << (8 - count)));
+        count = 0;
+    }
+
+private:
+    std::string& out;
+    uint64_t acc = 0;
+    int count = 0;
+};
+
+// Past the end it reads zeros, so a damaged block decodes to garbage but
+// never reads out of the mapping
+class BitReader
+{
+public:
+    BitReader(const char* data, size_t size) : p((const uint8_t*)data), end((const uint8_t*)data + size) {}
+
+    uint64_t read(int bits)
+    {
+        if (bits > 32)
+        {
+            uint64_t high = read(bits - 32);
+            return (high << 32) | read(32);
+        }
+        if (bits == 0) return 0;
+        while (avail <= 56)
+        {
+            buffer |= (uint64_t)(p < end ? *p++ : 0) << (56 - avail);
+            avail += 8;
+        }
+        uint64_t value = buffer >> (64 - bits);
+        buffer <<= bits;
+        avail -= bits;
+        return value;
+    }
+
+    bool bit() { return read(1) != 0; }
+
+private:
+    const uint8_t* p;
+    const uint8_t* end;
+    uint64_t buffer = 0;
+    int avail = 0;
+};
+
+// Delta-of-delta buckets: '0' for none, then 10/110/1110 with 7/9/12 bits,
+// 1111 with all 64
+static void encodeTimestamps(BitWriter& bits, const int64_t* ts, size_t count)
+{
+    bits.write(ts[0], 64);
+    int64_t prev_delta = 0;
+    for (size_t i = 1; i < count; i++)
+    {
+        int64_t delta = ts[i] - ts[i - 1];
+        int64_t dod = delta - prev_delta;
+        prev_delta = delta;
+        if (dod == 0)
+            bits.write(0, 1);
+        else if (dod >= -63 && dod <= 64)
+        {
+            bits.write(2, 2);
+            bits.write(dod + 63, 7);
+        }
+        else if (dod >= -255 && dod <= 256)
+        {
+            bits.write(6, 3);
+            bits.write(dod + 255, 9);
+        }
+        else if (dod >= -2047 && dod <= 2048)
+        {
+            bits.write(14, 4);
+            bits.write(dod + 2047, 12);
+        }
+        else
+        {
+            bits.write(15, 4);
+            bits.write(dod, 64);
+        }
+    }
+}
+
+static void decodeTimestamps(BitReader& bits, int64_t* ts, size_t count)
+{
+    ts[0] = bits.read(64);
+    int64_t delta = 0;
+    for (size_t i = 1; i < count; i++)
+    {
+        if (bits.bit())
+        {
+            if (!bits.bit())
+                delta += (int64_t)bits.read(7) - 63;
+            else if (!bits.bit())
+                delta += (int64_t)bits.read(9) - 255;
+            else if (!bits.bit())
+                delta += (int64_t)bits.read(12) - 2047;
+            else
+                delta += (int64_t)bits.read(64);
+        }
+        ts[i] = ts[i - 1] + delta;
+    }
+}
+
+// One sensor column of a block: XOR with the previous value, '0' if equal,
+// '10' + the meaningful bits if they fit the previous leading/trailing zero
+// window, else '11' + 5 bit leading zeros + 5 bit length - 1 + the bits
+static void encodeValues(BitWriter& bits, const float* values, size_t stride, size_t count)
+{
+    uint32_t prev;
+    memcpy(&prev, values, 4);
+    bits.write(prev, 32);
+
+    int leading = -1, trailing = 0;
+    for (size_t i = 1; i < count; i++)
+    {
+        uint32_t value;
+        memcpy(&value, values + i * stride, 4);
+        uint32_t x = value ^ prev;
+        prev = value;
+        if (x == 0)
+        {
+            bits.write(0, 1);
+            continue;
+        }
+
+        int lz = __builtin_clz(x);
+        int tz = __builtin_ctz(x);
+        if (leading >= 0 && lz >= leading && tz >= trailing)
+        {
+            bits.write(2, 2);
+            bits.write(x >> trailing, 32 - leading - trailing);
+            continue;
+        }
+        leading = lz;
+        trailing = tz;
+        int length = 32 - lz - tz;
+        bits.write(3, 2);
+        bits.write(lz, 5);
+        bits.write(length - 1, 5);
+        bits.write(x >> tz, length);
+    }
+}
+
+static void decodeValues(BitReader& bits, float* values, size_t stride, size_t count)
+{
+    uint32_t prev = bits.read(32);
+    memcpy(values, &prev, 4);
+
+    int leading = 0, trailing = 0;
+    for (size_t i = 1; i < count; i++)
+    {
+        if (bits.bit())
+        {
+            if (bits.bit())
+            {
+                leading = bits.read(5);
+                trailing = std::max(0, 32 - leading - ((int)bits.read(5) + 1));
+            }
+            prev ^= (uint32_t)bits.read(32 - leading - trailing) << trailing;
+        }
+        memcpy(values + i * stride, &prev, 4);
+    }
+}
+
+Segment::~Segment()
+{
+    close();
+}
+
+bool Segment::open(const std::string& path)
+{
+    close();
+
+    if (!file.open(path)) return false;
+
+    compressed = file.size() >= 4 && memcmp(file.data(), compressed_magic, 4) == 0;
+    hourly = file.size() >= 4 && memcmp(file.data(), hourly_magic, 4) == 0;
+    bool valid = compressed ? readHeader(file.descriptor(), labels, header_size, compressed_magic, compressed_version)
+               : hourly     ? readHeader(file.descriptor(), labels, header_size, hourly_magic, hourly_version)
+                            : readHeader(file.descriptor(), labels, header_size);
+    if (!valid || file.size() < header_size)
+    {
+        std::cerr << "Invalid segment " << path << "\n";
+        close();
+        return false;
+    }
+
+    if (hourly)
+    {
+        size_t sensors = labels.size();
+        size_t entry_size = rollupEntrySize(sensors);
+        rows = (file.size() - header_size) / entry_size;
+        hour_rollups.resize(rows);
+        decoded.sensors = sensors;
+        decoded.timestamps.resize(rows);
+        decoded.values.resize(rows * sensors);
+        for (size_t i = 0; i < rows; i++)
+        {
+            Rollup& hour = hour_rollups[i];
+            decodeRollup(file.data() + header_size + i * entry_size, sensors, hour);
+            decoded.timestamps[i] = hour.start;
+            for (size_t col = 0; col < sensors; col++)
+            {
+                const SensorRollup& sensor = hour.sensors[col];
+                decoded.values[i * sensors + col] = sensor.count > 0 ? (float)(sensor.sum / sensor.count) : NAN;
+            }
+        }
+        return true;
+    }
+
+    record_size = sizeof(int64_t) + labels.size() * sizeof(float);
+    if (!compressed)
+    {
+        // a record still being appended by the getter is not counted
+        rows = (file.size() - header_size) / record_size;
+        return true;
+    }
+
+    uint64_t row_count = 0;
+    uint32_t per_block = 0, block_count = 0;
+    const char* p = file.data() + header_size;
+    if (file.size() >= header_size + 16)
+    {
+        memcpy(&row_count, p, 8);
+        memcpy(&per_block, p + 8, 4);
+        memcpy(&block_count, p + 12, 4);
+    }
+    if (per_block == 0 || block_count != (row_count + per_block - 1) / per_block ||
+        file.size() < header_size + 16 + (size_t)block_count * block_entry_size)
+    {
+        std::cerr << "Invalid segment " << path << "\n";
+        close();
+        return false;
+    }
+    rows = row_count;
+    block_rows = per_block;
+    blocks = block_count;
+    directory = p + 16;
+    return true;
+}
+
+bool Segment::refresh()
+{
+    size_t old_rows = rows;
+    if (!compressed && !hourly && file.remap())
+        rows = (file.size() - header_size) / record_size;
+    return rows > old_rows;
+}
+
+void Segment::close()
+{
+    file.close();
+    rows = 0;
+    labels.clear();
+    compressed = false;
+    blocks = 0;
+    directory = nullptr;
+    decoded_block = SIZE_MAX;
+    hourly = false;
+    hour_rollups.clear();
+}
+
+int64_t Segment::blockTimestamp(size_t b) const
+{
+    int64_t ts;
+    memcpy(&ts, directory + b * block_entry_size, sizeof(ts));
+    return ts;
+}
+
+void Segment::decodeBlock(size_t b) const
+{
+    if (decoded_block == b) return;
+
+    uint64_t offset, next = file.size();
+    memcpy(&offset, directory + b * block_entry_size + 8, 8);
+    if (b + 1 < blocks)
+        memcpy(&next, directory + (b + 1) * block_entry_size + 8, 8);
+    next = std::min<uint64_t>(next, file.size());
+    offset = std::min(offset, next);
+
+    size_t count = std::min(block_rows, rows - b * block_rows);
+    size_t sensors = labels.size();
+    decoded.sensors = sensors;
+    decoded.timestamps.resize(count);
+    decoded.values.resize(count * sensors);
+
+    BitReader bits(file.data() + offset, next - offset);
+    decodeTimestamps(bits, decoded.timestamps.data(), count);
+    for (size_t col = 0; col < sensors; col++)
+        decodeValues(bits, decoded.values.data() + col, sensors, count);
+    decoded_block = b;
+}
+
+int64_t Segment::timestampAt(size_t row) const
+{
+    if (hourly)
+        return decoded.timestamps[row];
+    if (compressed)
+    {
+        decodeBlock(row / block_rows);
+        return decoded.timestamps[row % block_rows];
+    }
+
+    int64_t ts;
+    memcpy(&ts, file.data() + header_size + row * record_size, sizeof(ts));
+    return ts;
+}
+
+size_t Segment::lowerBound(int64_t ts) const
+{
+    if (hourly)
+        return std::lower_bound(decoded.timestamps.begin(), decoded.timestamps.end(), ts) - decoded.timestamps.begin();
+    if (compressed)
+    {
+        // the first block starting at or after ts; the row may still be at
+        // the end of the one before it
+        size_t lo = 0, hi = blocks;
+        while (lo < hi)
+        {
+            size_t mid = lo + (hi - lo) / 2;
+            if (blockTimestamp(mid) < ts)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo == 0)
+            return 0;
+        decodeBlock(lo - 1);
+        auto it = std::lower_bound(decoded.timestamps.begin(), decoded.timestamps.end(), ts);
+        return (lo - 1) * block_rows + (it - decoded.timestamps.begin());
+    }
+
+    size_t lo = 0, hi = rows;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (timestampAt(mid) < ts)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+size_t Segment::read(size_t first_row, size_t max_rows, SampleBlock& block) const
+{
+    block.timestamps.clear();
+    block.values.clear();
+    block.sensors = labels.size();
+
+    if (first_row >= rows) return 0;
+    size_t count = std::min(max_rows, rows - first_row);
+
+    block.timestamps.resize(count);
+    block.values.resize(count * block.sensors);
+    if (hourly)
+    {
+        std::copy_n(decoded.timestamps.begin() + first_row, count, block.timestamps.begin());
+        std::copy_n(decoded.values.begin() + first_row * block.sensors, count * block.sensors, block.values.begin());
+        return count;
+    }
+    if (compressed)
+    {
+        for (size_t done = 0; done < count;)
+        {
+            size_t row = first_row + done;
+            decodeBlock(row / block_rows);
+            size_t in_block = row % block_rows;
+            size_t n = std::min(count - done, decoded.rows() - in_block);
+            std::copy_n(decoded.timestamps.begin() + in_block, n, block.timestamps.begin() + done);
+            std::copy_n(decoded.values.begin() + in_block * block.sensors, n * block.sensors,
+                        block.values.begin() + done * block.sensors);
+            done += n;
+        }
+        return count;
+    }
+
+    const char* rec = file.data() + header_size + first_row * record_size;
+    for (size_t i = 0; i < count; i++, rec += record_size)
+    {
+        memcpy(&block.timestamps[i], rec, sizeof(int64_t));
+        memcpy(&block.values[i * block.sensors], rec + sizeof(int64_t), block.sensors * sizeof(float));
+    }
+    return count;
+}
+
+// Writes rows as a compressed segment. The file is synced and decoded again
+// before it takes the place of whatever path held, which may be the only
+// copy of the samples.
+static bool writeCompressed(const std::string& path, const std::vector<std::string>& labels, const SampleBlock& rows)
+{
+    uint64_t count = rows.rows();
+    uint32_t block_rows = compressed_block_rows;
+    uint32_t blocks = (count + block_rows - 1) / block_rows;
+    std::string out = buildHeader(labels, compressed_magic, compressed_version);
+    out.append((const char*)&count, 8);
+    out.append((const char*)&block_rows, 4);
+    out.append((const char*)&blocks, 4);
+    size_t directory = out.size();
+    out.resize(directory + blocks * block_entry_size);
+
+    size_t sensors = labels.size();
+    for (uint32_t b = 0; b < blocks; b++)
+    {
+        size_t first = (size_t)b * block_rows;
+        size_t n = std::min<size_t>(block_rows, count - first);
+        uint64_t offset = out.size();
+        memcpy(&out[directory + b * block_entry_size], &rows.timestamps[first], 8);
+        memcpy(&out[directory + b * block_entry_size + 8], &offset, 8);
+
+        BitWriter bits(out);
+        encodeTimestamps(bits, rows.timestamps.data() + first, n);
+        for (size_t col = 0; col < sensors; col++)
+            encodeValues(bits, rows.values.data() + first * sensors + col, sensors, n);
+        bits.finish();
+    }
+
+    std::string tmp_path = tempPath(path);
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok = writeAll(fd, out.data(), out.size()) && fdatasync(fd) == 0;
+    ::close(fd);
+
+    Segment check;
+    SampleBlock decoded;
+    ok = ok && check.open(tmp_path) && check.read(0, count, decoded) == count &&
+         decoded.timestamps == rows.timestamps &&
+         memcmp(decoded.values.data(), rows.values.data(), rows.values.size() * sizeof(float)) == 0;
+
+    if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        std::cerr << "Failed to write " << path << "\n";
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool compressSegment(const std::string& path)
+{
+    Segment segment;
+    SampleBlock rows;
+    if (!segment.open(path))
+        return false;
+    if (segment.isCompressed() || segment.isHourly() || segment.rowCount() == 0)
+        return true;
+    segment.read(0, segment.rowCount(), rows);
+    return writeCompressed(path, segment.labels, rows);
+}
+
+long compressHistory(const std::string& ip)
+{
+    std::string dir = deviceDir(ip);
+    std::vector<SegmentInfo> index;
+    if (!loadIndex(dir, index) || index.empty())
+        return -1;
+
+    long compressed = 0;
+    for (size_t i = 0; i + 1 < index.size(); i++)
+    {
+        Segment segment;
+        if (!index[i].isRaw() || !segment.open(dir + index[i].name) || segment.isCompressed() || segment.rowCount() == 0)
+            continue;
+        segment.close();
+        if (compressSegment(dir + index[i].name))
+            compressed++;
+    }
+    return compressed;
+}
+
+// Aggregates a segment by local hour, stamped with the hour start. Like
+// computeRollups(), prev_ts and prev_values are the sample before the
+// segment, and each interval's energy goes to the hour of its later sample.
+static void hourlyRollups(const Segment& segment, int64_t prev_ts, const std::vector<float>& prev_values,
+                          std::vector<Rollup>& hours)
+{
+    size_t sensors = segment.sensorCount();
+    hours.clear();
+
+    SampleBlock block;
+    int64_t hour_end = INT64_MIN;
+    std::vector<float> prev = prev_values;
+    prev.resize(sensors, NAN);
+    std::vector<double> areas(sensors);
+
+    for (size_t next = 0; size_t got = segment.read(next, 4096, block); next += got)
+    {
+        for (size_t i = 0; i < got; i++)
+        {
+            int64_t ts = block.timestamps[i];
+            if (ts >= hour_end)
+            {
+                std::tm t = localTm(ts);
+                hours.push_back(Rollup());
+                hours.back().start = ts - t.tm_min * 60 - t.tm_sec;
+                hours.back().sensors.resize(sensors);
+                hour_end = hours.back().start + 3600;
+            }
+
+            const float* values = block.row(i);
+            integrateInterval(i > 0 ? block.row(i - 1) : prev.data(), values, sensors,
+                              prev_ts > 0 ? ts - prev_ts : 0, areas.data());
+            hours.back().add(values, areas.data());
+            prev_ts = ts;
+        }
+        prev.assign(block.row(got - 1), block.row(got - 1) + sensors);
+    }
+}
+
+// Writes an hourly segment. Like writeCompressed() the file is synced and
+// read back before it replaces whatever path held.
+static bool writeHourly(const std::string& path, const std::vector<std::string>& labels, const std::vector<Rollup>& hours)
+{
+    std::string out = buildHeader(labels, hourly_magic, hourly_version);
+    for (const Rollup& hour : hours)
+        encodeRollup(out, hour);
+
+    std::string tmp_path = tempPath(path);
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok = writeAll(fd, out.data(), out.size()) && fdatasync(fd) == 0;
+    ::close(fd);
+
+    Segment check;
+    ok = ok && check.open(tmp_path) && check.isHourly() && check.rowCount() == hours.size() &&
+         (hours.empty() || check.hours().back().start == hours.back().start);
+
+    if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        std::cerr << "Failed to write " << path << "\n";
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+static bool sameRollup(const Rollup& a, const Rollup& b)
+{
+    if (a.start != b.start || a.samples != b.samples || a.sensors.size() != b.sensors.size())
+        return false;
+    for (size_t s = 0; s < a.sensors.size(); s++)
+    {
+        const SensorRollup& x = a.sensors[s];
+        const SensorRollup& y = b.sensors[s];
+        // min and max are NaN while a sensor has no samples
+        if (x.sum != y.sum || x.energy != y.energy || x.count != y.count ||
+            memcmp(&x.min, &y.min, sizeof(float)) != 0 || memcmp(&x.max, &y.max, sizeof(float)) != 0)
+            return false;
+    }
+    return true;
+}
+
+// Makes sure the rollups of index[i] match its samples, before retention
+// leaves them as the only full-resolution summary of the month or compaction
+// seals it. They are computed again and compared field by field, so stale
+// sums or a different max gap are repaired too; this reads the whole segment,
+// which both callers do once per month.
+static bool checkRollups(const std::string& dir, const std::vector<SegmentInfo>& index, size_t i)
+{
+    SegmentRollups stored;
+    bool readable = readRollups(dir + rollupName(index[i].name), stored);
+
+    Segment segment;
+    if (!index[i].hasSamples() || !segment.open(dir + index[i].name))
+        return readable;
+    int64_t prev_ts = 0;
+    std::vector<float> prev_values;
+    if (i > 0 && index[i - 1].hasSamples())
+        readLastRow(dir + index[i - 1].name, segment.labels, prev_ts, prev_values);
+    SegmentRollups rollups;
+    computeRollups(segment, prev_ts, prev_values, rollups);
+
+    bool same = readable && stored.labels == rollups.labels && stored.max_gap == rollups.max_gap &&
+                sameRollup(stored.month, rollups.month) && stored.days.size() == rollups.days.size();
+    for (size_t d = 0; same && d < rollups.days.size(); d++)
+        same = sameRollup(stored.days[d], rollups.days[d]);
+    if (same)
+        return true;
+    std::cout << "Repairing the rollups of " << dir << index[i].name << std::endl;
+    return writeRollups(dir + rollupName(index[i].name), rollups);
+}
+
+bool applyRetention(const std::string& ip, const RetentionPolicy& policy, int64_t now)
+{
+    // the entries are rewritten in place, so the index has to be the file
+    // and not one rebuilt from the segments
+    std::string dir = deviceDir(ip);
+    std::string index_path = dir + "index";
+    std::vector<SegmentInfo> index;
+    if (access(index_path.c_str(), F_OK) != 0 || !loadIndex(dir, index))
+        return false;
+
+    // files the last call replaced; readers have had time to move on
+    for (const SegmentInfo& info : index)
+    {
+        std::string month = info.name.substr(0, info.name.find('.'));
+        if (!info.isRaw())
+            unlink((dir + month + ".snse").c_str());
+        if (!info.hasSamples())
+            unlink((dir + month + ".hour.snse").c_str());
+    }
+
+    int64_t raw_limit = policy.raw_days > 0 ? now - policy.raw_days * 86400LL : INT64_MIN;
+    int64_t hourly_limit = INT64_MIN;
+    if (policy.hourly_months > 0)
+    {
+        std::tm t = localTm(now);
+        int month = t.tm_year * 12 + t.tm_mon - policy.hourly_months;
+        hourly_limit = makeLocalTime(1900 + month / 12, month % 12 + 1, 1);
+    }
+
+    int fd = -1;
+    bool ok = true;
+    for (size_t i = 0; i + 1 < index.size(); i++)
+    {
+        SegmentInfo info = index[i];
+        if (!info.hasSamples() || info.rows == 0)
+            continue;
+
+        int64_t month_end = nextPeriodStart(info.last_ts, PERIOD_MONTH);
+        std::string month = info.name.substr(0, info.name.find('.'));
+        bool drop = month_end <= hourly_limit;
+        if (!drop && !(info.isRaw() && month_end <= raw_limit))
+            continue;
+        if (!checkRollups(dir, index, i))
+        {
+            std::cerr << "Keeping " << dir << info.name << ", its rollups could not be checked\n";
+            ok = false;
+            continue;
+        }
+
+        if (drop)
+        {
+            info.name = month + ".roll";
+            info.rows = 0;
+        }
+        else
+        {
+            Segment segment;
+            std::vector<Rollup> hours;
+            if (!segment.open(dir + info.name))
+                continue;
+            int64_t prev_ts = 0;
+            std::vector<float> prev_values;
+            if (i > 0 && index[i - 1].hasSamples())
+                readLastRow(dir + index[i - 1].name, segment.labels, prev_ts, prev_values);
+            hourlyRollups(segment, prev_ts, prev_values, hours);
+            info.name = month + ".hour.snse";
+            if (hours.empty() || !writeHourly(dir + info.name, segment.labels, hours))
+            {
+                ok = false;
+                continue;
+            }
+            info.first_ts = hours.front().start;
+            info.last_ts = hours.back().start;
+            info.rows = hours.size();
+        }
+
+        char entry[index_entry_size];
+        encodeIndexEntry(entry, info);
+        if (fd < 0)
+            fd = ::open(index_path.c_str(), O_WRONLY);
+        if (fd < 0 || !pwriteAll(fd, entry, sizeof(entry), index_header_size + i * index_entry_size))
+        {
+            ok = false;
+            break;
+        }
+        std::cout << "Retention: " << dir << index[i].name << " is now " << info.name << std::endl;
+    }
+
+    if (fd >= 0)
+    {
+        ok = fdatasync(fd) == 0 && ok;
+        ::close(fd);
+    }
+    return ok;
+}
+
+bool compactDevice(const std::string& ip, const std::function<void(size_t)>& pace)
+{
+    std::string dir = deviceDir(ip);
+    std::vector<SegmentInfo> index;
+    if (!loadIndex(dir, index))
+        return false;
+
+    // temporary files of rewrites that were interrupted; anything still
+    // being written is much younger than this
+    if (DIR* d = opendir(dir.c_str()))
+    {
+        time_t limit = std::time(nullptr) - 3600;
+        while (dirent* entry = readdir(d))
+        {
+            std::string name = entry->d_name;
+            struct stat st;
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0 &&
+                stat((dir + name).c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_mtime < limit)
+                unlink((dir + name).c_str());
+        }
+        closedir(d);
+    }
+
+    // the last segment belongs to the writer, the others never change again
+    // except through a rename, so a reader has either the old file or the new
+    bool ok = true;
+    for (size_t i = 0; i + 1 < index.size(); i++)
+    {
+        if (!index[i].isRaw() || index[i].rows == 0)
+            continue;
+        std::string path = dir + index[i].name;
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+            continue;
+
+        // each step reads the whole segment, wait before it and not after,
+        // so no burst goes past the limit
+        pace((size_t)st.st_size);
+        if (!checkRollups(dir, index, i))
+            ok = false;
+
+        Segment segment;
+        if (!segment.open(path) || segment.isCompressed())
+            continue;
+        segment.close();
+        pace((size_t)st.st_size);
+        if (!compressSegment(path))
+            ok = false;
+    }
+    return ok;
+}
+
+bool rebuildIndex(const std::string& dir, std::vector<SegmentInfo>& index)
+{
+    index.clear();
+    DIR* d = opendir(dir.c_str());
+    if (d == nullptr) return false;
+
+    // a month may have its raw samples, its hourly means or only its rollups
+    // left (see applyRetention); the most detailed one wins
+    auto detail = [](const SegmentInfo& info) { return info.isRaw() ? 3 : info.hasSamples() ? 2 : 1; };
+    std::map<std::string, SegmentInfo> months;
+    while (dirent* entry = readdir(d))
+    {
+        SegmentInfo info;
+        info.name = entry->d_name;
+        bool segment = info.name.size() >= 5 && info.name.compare(info.name.size() - 5, 5, ".snse") == 0;
+        if (!segment && info.hasSamples())
+            continue;
+
+        SegmentInfo& best = months[rollupName(info.name)];
+        if (best.name.empty() || detail(info) > detail(best))
+            best = info;
+    }
+    closedir(d);
+
+    for (const auto& month : months)
+    {
+        SegmentInfo info = month.second;
+        if (info.hasSamples())
+        {
+            Segment segment;
+            if (!segment.open(dir + info.name) || segment.rowCount() == 0)
+                continue;
+            info.first_ts = segment.timestampAt(0);
+            info.last_ts = segment.timestampAt(segment.rowCount() - 1);
+            info.rows = segment.rowCount();
+        }
+        else
+        {
+            SegmentRollups rollups;
+            if (!readRollups(dir + info.name, rollups) || rollups.month.samples == 0)
+                continue;
+            for (const Rollup& day : rollups.days)
+            {
+                if (day.samples == 0) continue;
+                if (info.first_ts == 0)
+                    info.first_ts = day.start;
+                info.last_ts = day.start;
+            }
+        }
+        index.push_back(info);
+    }
+
+    std::sort(index.begin(), index.end(), [](const SegmentInfo& a, const SegmentInfo& b)
+    {
+        return a.first_ts < b.first_ts;
+    });
+    return true;
+}
+
+void computeRollups(const Segment& segment, int64_t prev_ts, const std::vector<float>& prev_values,
+                    SegmentRollups& rollups)
+{
+    size_t sensors = segment.sensorCount();
+    rollups.labels = segment.labels;
+    rollups.max_gap = max_energy_gap;
+    rollups.month = Rollup();
+    rollups.month.sensors.resize(sensors);
+    rollups.days.clear();
+    if (segment.rowCount() > 0)
+        rollups.month.start = periodStart(segment.timestampAt(0), PERIOD_MONTH);
+
+    // the samples are gone, but their hour aggregates add up to the same days
+    if (segment.isHourly())
+    {
+        for (const Rollup& hour : segment.hours())
+        {
+            if (rollups.days.empty() || hour.start >= nextPeriodStart(rollups.days.back().start, PERIOD_DAY))
+            {
+                rollups.days.push_back(Rollup());
+                rollups.days.back().start = periodStart(hour.start, PERIOD_DAY);
+                rollups.days.back().sensors.resize(sensors);
+            }
+            rollups.days.back().merge(hour);
+            rollups.month.merge(hour);
+        }
+        return;
+    }
+
+    SampleBlock block;
+    int64_t day_end = 0;
+    size_t next = 0;
+    std::vector<float> prev = prev_values;
+    prev.resize(sensors, NAN);
+    std::vector<double> areas(sensors);
+
+    while (size_t got = segment.read(next, 4096, block))
+    {
+        for (size_t i = 0; i < got; i++)
+        {
+            int64_t ts = block.timestamps[i];
+            if (rollups.days.empty() || ts >= day_end)
+            {
+                rollups.days.push_back(Rollup());
+                rollups.days.back().start = periodStart(ts, PERIOD_DAY);
+                rollups.days.back().sensors.resize(sensors);
+                day_end = nextPeriodStart(ts, PERIOD_DAY);
+            }
+
+            const float* values = block.row(i);
+            integrateInterval(i > 0 ? block.row(i - 1) : prev.data(), values, sensors,
+                              prev_ts > 0 ? ts - prev_ts : 0, areas.data());
+            rollups.days.back().add(values, areas.data());
+            rollups.month.add(values, areas.data());
+            prev_ts = ts;
+        }
+        prev.assign(block.row(got - 1), block.row(got - 1) + sensors);
+        next += got;
+    }
+}
+
+bool readRollups(const std::string& path, SegmentRollups& rollups)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    size_t header_size = 0;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !readHeader(fd, rollups.labels, header_size, rollup_magic, rollup_version))
+    {
+        ::close(fd);
+        return false;
+    }
+
+    size_t entry_size = rollupEntrySize(rollups.labels.size());
+    size_t entries = ((size_t)st.st_size - header_size) / entry_size;
+    std::vector<char> raw(entries * entry_size);
+    bool ok = entries > 0 && readExact(fd, raw.data(), raw.size(), header_size);
+    ::close(fd);
+    if (!ok) return false;
+
+    uint32_t max_gap;
+    memcpy(&max_gap, raw.data() + 12, 4);
+    rollups.max_gap = max_gap;
+    decodeRollup(raw.data(), rollups.labels.size(), rollups.month);
+    rollups.days.resize(entries - 1);
+    for (size_t i = 1; i < entries; i++)
+        decodeRollup(raw.data() + i * entry_size, rollups.labels.size(), rollups.days[i - 1]);
+    return true;
+}
+
+bool writeRollups(const std::string& path, const SegmentRollups& rollups)
+{
+    std::string out = buildHeader(rollups.labels, rollup_magic, rollup_version);
+    encodeRollup(out, rollups.month);
+    for (const Rollup& day : rollups.days)
+        encodeRollup(out, day);
+
+    // synced before the rename: past retention this may be all that is
+    // left of the month
+    std::string tmp_path = tempPath(path);
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok = writeAll(fd, out.data(), out.size()) && fdatasync(fd) == 0;
+    ::close(fd);
+
+    if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        std::cerr << "Failed to write " << path << "\n";
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool rebuildRollups(const std::string& ip)
+{
+    std::string dir = deviceDir(ip);
+    std::vector<SegmentInfo> index;
+    if (!loadIndex(dir, index) || index.empty())
+        return false;
+
+    int64_t prev_ts = 0;
+    std::vector<float> prev_values;
+    std::vector<std::string> prev_labels;
+    for (const SegmentInfo& info : index)
+    {
+        // past raw retention the rollups are all that is left of the samples
+        Segment segment;
+        SegmentRollups rollups;
+        if (!info.isRaw() || !segment.open(dir + info.name))
+            continue;
+
+        computeRollups(segment, prev_ts, remapRow(prev_labels, prev_values, segment.labels), rollups);
+        if (!writeRollups(dir + rollupName(info.name), rollups))
+            return false;
+
+        SampleBlock block;
+        if (segment.rowCount() > 0 && segment.read(segment.rowCount() - 1, 1, block) == 1)
+        {
+            prev_ts = block.timestamps[0];
+            prev_values = block.values;
+            prev_labels = segment.labels;
+        }
+    }
+    return true;
+}
+
+// Days of the period catalog; an entry cut short by a crash is left out
+static bool readPeriods(const std::string& path, std::vector<int64_t>& days)
+{
+    days.clear();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    char header[periods_header_size] = {};
+    uint32_t version = 0;
+    bool ok = fstat(fd, &st) == 0 && readExact(fd, header, sizeof(header), 0);
+    memcpy(&version, header + 4, 4);
+    ok = ok && memcmp(header, periods_magic, 4) == 0 && version == periods_version;
+    if (ok)
+    {
+        days.resize(((size_t)st.st_size - periods_header_size) / sizeof(int64_t));
+        ok = days.empty() || readExact(fd, days.data(), days.size() * sizeof(int64_t), periods_header_size);
+    }
+    ::close(fd);
+    return ok;
+}
+
+static bool writePeriods(const std::string& path, const std::vector<int64_t>& days)
+{
+    std::string out(periods_magic, 4);
+    out.append((const char*)&periods_version, 4);
+    out.append((const char*)days.data(), days.size() * sizeof(int64_t));
+
+    std::string tmp_path = tempPath(path);
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok = writeAll(fd, out.data(), out.size());
+    ::close(fd);
+
+    if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        std::cerr << "Failed to write " << path << "\n";
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// A catalog is trusted when it starts on the day of the oldest sample and
+// ends on the day of the newest one (0 if there are none)
+static bool periodsCover(const std::vector<int64_t>& days, int64_t first_ts, int64_t last_ts)
+{
+    if (first_ts == 0 || last_ts == 0)
+        return days.empty() && first_ts == last_ts;
+    return !days.empty() && days.front() == periodStart(first_ts, PERIOD_DAY) &&
+           days.back() == periodStart(last_ts, PERIOD_DAY);
+}
+
+static int64_t firstTimestamp(const std::vector<SegmentInfo>& index)
+{
+    for (const SegmentInfo& info : index)
+    {
+        if (info.rows > 0 || !info.hasSamples())
+            return info.first_ts;
+    }
+    return 0;
+}
+
+// Periods with samples, straight from the segments: one binary search per
+// period jumps to the next one, the rows in between are never read
+static void collectPeriods(const std::string& dir, const std::vector<SegmentInfo>& index, Period period,
+                           std::vector<int64_t>& starts)
+{
+    starts.clear();
+    for (const SegmentInfo& info : index)
+    {
+        // a month past retention still has its day rollups
+        if (!info.hasSamples())
+        {
+            SegmentRollups rollups;
+            if (!readRollups(dir + info.name, rollups)) continue;
+            for (const Rollup& day : rollups.days)
+            {
+                int64_t start = periodStart(day.start, period);
+                if (day.samples > 0 && (starts.empty() || start > starts.back()))
+                    starts.push_back(start);
+            }
+            continue;
+        }
+
+        Segment segment;
+        if (!segment.open(dir + info.name)) continue;
+
+        size_t row = 0;
+        while (row < segment.rowCount())
+        {
+            int64_t start = periodStart(segment.timestampAt(row), period);
+            if (starts.empty() || start > starts.back())
+                starts.push_back(start);
+            row = segment.lowerBound(nextPeriodStart(start, period));
+        }
+    }
+}
+
+bool loadIndex(const std::string& dir, std::vector<SegmentInfo>& index)
+{
+    index.clear();
+    int fd = ::open((dir + "index").c_str(), O_RDONLY);
+    if (fd < 0)
+        return rebuildIndex(dir, index);
+
+    struct stat st;
+    char header[index_header_size] = {};
+    uint32_t version = 0;
+    bool valid = fstat(fd, &st) == 0 && readExact(fd, header, sizeof(header), 0);
+    memcpy(&version, header + 4, 4);
+    if (!valid || memcmp(header, index_magic, 4) != 0 || version != index_version)
+    {
+        ::close(fd);
+        std::cerr << "Invalid index in " << dir << ", rebuilding it\n";
+        return rebuildIndex(dir, index);
+    }
+
+    size_t entries = ((size_t)st.st_size - index_header_size) / index_entry_size;
+    std::vector<char> raw(entries * index_entry_size);
+    bool ok = raw.empty() || readExact(fd, raw.data(), raw.size(), index_header_size);
+    ::close(fd);
+    if (!ok) return rebuildIndex(dir, index);
+
+    index.resize(entries);
+    for (size_t i = 0; i < entries; i++)
+    {
+        const char* entry = raw.data() + i * index_entry_size;
+        memcpy(&index[i].first_ts, entry, 8);
+        memcpy(&index[i].last_ts, entry + 8, 8);
+        memcpy(&index[i].rows, entry + 16, 8);
+        index[i].name = std::string(entry + 24, strnlen(entry + 24, index_name_size));
+    }
+    return true;
+}
+
+bool DeviceStore::open(const std::string& ip)
+{
+    dir = deviceDir(ip);
+    labels.clear();
+    if (!loadIndex(dir, index) || index.empty())
+        return false;
+
+    Segment newest;
+    if (!newest.open(dir + index.back().name))
+        return false;
+    labels = newest.labels;
+    return true;
+}
+
+size_t DeviceStore::rowCount() const
+{
+    size_t rows = 0;
+    for (const SegmentInfo& info : index)
+        rows += info.rows;
+    return rows;
+}
+
+int64_t DeviceStore::timestampAt(size_t row) const
+{
+    for (const SegmentInfo& info : index)
+    {
+        if (row >= info.rows)
+        {
+            row -= info.rows;
+            continue;
+        }
+        Segment segment;
+        if (!segment.open(dir + info.name)) return 0;
+        return segment.timestampAt(row);
+    }
+    return 0;
+}
+
+int64_t DeviceStore::lastTimestamp() const
+{
+    Segment segment;
+    if (index.empty() || !segment.open(dir + index.back().name) || segment.rowCount() == 0)
+        return 0;
+    return segment.timestampAt(segment.rowCount() - 1);
+}
+
+void DeviceStore::overlapping(int64_t from, int64_t to, size_t& first, size_t& last) const
+{
+    // segments are sorted and disjoint, so both bounds can be binary searched;
+    // the newest segment may have grown past its index entry
+    first = std::lower_bound(index.begin(), index.end(), from, [&](const SegmentInfo& info, int64_t ts)
+    {
+        return &info != &index.back() && info.last_ts < ts;
+    }) - index.begin();
+
+    last = std::lower_bound(index.begin() + first, index.end(), to, [](const SegmentInfo& info, int64_t ts)
+    {
+        return info.first_ts < ts;
+    }) - index.begin();
+}
+
+// Calls task(0) to task(count - 1), each once, on up to aggregation_threads
+// threads. Tasks are handed out one at a time, so a long one does not hold
+// up the others.
+static void parallelFor(size_t count, const std::function<void(size_t)>& task)
+{
+    std::atomic<size_t> next{0};
+    auto run = [&]
+    {
+        for (size_t i = next++; i < count; i = next++)
+            task(i);
+    };
+
+    std::vector<std::thread> helpers;
+    for (size_t t = 1; t < std::min<size_t>(aggregation_threads, count); t++)
+        helpers.emplace_back(run);
+    run();
+    for (std::thread& helper : helpers)
+        helper.join();
+}
+
+std::vector<Rollup> DeviceStore::rollups(int64_t from, int64_t to, Period period) const
+{
+    std::vector<Rollup> result;
+    size_t first, last;
+    overlapping(from, to, first, last);
+
+    // a sealed segment must agree with its index entry; the active one may be
+    // a sample ahead of or behind it. Past raw retention the rollups are what
+    // is left of the samples and are taken as they are.
+    std::vector<SegmentRollups> per_segment(last - first);
+    std::vector<char> usable(last - first, 1);
+    std::vector<size_t> stale;
+    for (size_t seg_i = first; seg_i < last; seg_i++)
+    {
+        bool active = seg_i == index.size() - 1;
+        if (!readRollups(dir + rollupName(index[seg_i].name), per_segment[seg_i - first]) ||
+            (!active && index[seg_i].isRaw() && per_segment[seg_i - first].month.samples != index[seg_i].rows))
+            stale.push_back(seg_i);
+    }
+
+    // each month without rollups is a full scan of its samples
+    parallelFor(stale.size(), [&](size_t i)
+    {
+        size_t seg_i = stale[i];
+        Segment segment;
+        if (!index[seg_i].hasSamples() || !segment.open(dir + index[seg_i].name))
+        {
+            usable[seg_i - first] = 0;
+            return;
+        }
+        int64_t prev_ts = 0;
+        std::vector<float> prev_values;
+        if (seg_i > 0)
+            readLastRow(dir + index[seg_i - 1].name, segment.labels, prev_ts, prev_values);
+        computeRollups(segment, prev_ts, prev_values, per_segment[seg_i - first]);
+    });
+
+    std::vector<int> mapping;
+    for (size_t seg_i = first; seg_i < last; seg_i++)
+    {
+        if (!usable[seg_i - first]) continue;
+        SegmentRollups& segment_rollups = per_segment[seg_i - first];
+        mapColumns(segment_rollups.labels, mapping);
+
+        std::vector<Rollup*> picked;
+        if (period == PERIOD_MONTH)
+            picked.push_back(&segment_rollups.month);
+        else
+            for (Rollup& day : segment_rollups.days)
+                picked.push_back(&day);
+
+        for (Rollup* rollup : picked)
+        {
+            if (rollup->samples == 0 || rollup->start < from || rollup->start >= to)
+                continue;
+            result.push_back(mapRollup(*rollup, mapping));
+        }
+    }
+    return result;
+}
+
+std::vector<Rollup> DeviceStore::aggregate(int64_t from, int64_t to, int64_t step) const
+{
+    std::vector<Rollup> result;
+    if (step <= 0 || from >= to)
+        return result;
+
+    const int64_t day = 24 * 3600;
+    if (step % day == 0 && periodStart(from, PERIOD_DAY) == from && periodStart(to, PERIOD_DAY) == to)
+    {
+        // days are 23 to 25 hours long, rounding to the nearest day absorbs that
+        for (const Rollup& rollup : rollups(from, to, PERIOD_DAY))
+        {
+            int64_t bucket = (rollup.start - from + day / 2) / step;
+            int64_t start = periodStart(from + bucket * step + day / 2, PERIOD_DAY);
+            if (result.empty() || result.back().start != start)
+            {
+                result.push_back(Rollup());
+                result.back().start = start;
+                result.back().sensors.resize(labels.size());
+            }
+            result.back().merge(rollup);
+        }
+        return result;
+    }
+
+    // long ranges are cut at bucket boundaries into one chunk per thread;
+    // each chunk starts a gap early, as the samples just before it only give
+    // its first interval its energy, so the chunks add up to a single pass
+    size_t first, last;
+    uint64_t rows = 0;
+    overlapping(from, to, first, last);
+    for (size_t seg_i = first; seg_i < last; seg_i++)
+        rows += index[seg_i].rows;
+    int64_t buckets = (to - from + step - 1) / step;
+    size_t chunk_count = (size_t)std::max<int64_t>(1, std::min<int64_t>(
+        { (int64_t)aggregation_threads, (int64_t)(rows / min_parallel_rows), buckets }));
+
+    std::vector<std::vector<Rollup>> chunks(chunk_count);
+    size_t sensors = labels.size();
+    parallelFor(chunk_count, [&](size_t c)
+    {
+        int64_t chunk_from = from + buckets * (int64_t)c / (int64_t)chunk_count * step;
+        int64_t chunk_to = std::min(to, from + buckets * (int64_t)(c + 1) / (int64_t)chunk_count * step);
+        std::vector<Rollup>& chunk_result = chunks[c];
+        std::vector<float> prev(sensors, NAN);
+        std::vector<double> areas(sensors);
+        int64_t prev_ts = 0;
+
+        auto bucket = [&](int64_t ts) -> Rollup&
+        {
+            int64_t start = from + (ts - from) / step * step;
+            if (chunk_result.empty() || chunk_result.back().start != start)
+            {
+                chunk_result.push_back(Rollup());
+                chunk_result.back().start = start;
+                chunk_result.back().sensors.resize(sensors);
+            }
+            return chunk_result.back();
+        };
+        auto addSample = [&](int64_t ts, const float* values)
+        {
+            integrateInterval(prev.data(), values, sensors, prev_ts > 0 ? ts - prev_ts : 0, areas.data());
+            std::copy(values, values + sensors, prev.begin());
+            prev_ts = ts;
+            if (ts >= chunk_from)
+                bucket(ts).add(values, areas.data());
+        };
+
+        // months past raw retention only have their hour aggregates, and past
+        // hourly retention their day rollups: these go into the buckets whole,
+        // in the bucket their hour or day starts in, so steps shorter than that
+        // get one row per hour or day there. The raw months between them are
+        // read as samples.
+        size_t seg_first, seg_last;
+        std::vector<int> mapping;
+        int64_t samples_from = chunk_from - max_energy_gap;
+        overlapping(chunk_from, chunk_to, seg_first, seg_last);
+        for (size_t seg_i = seg_first; seg_i < seg_last; seg_i++)
+        {
+            if (index[seg_i].isRaw())
+                continue;
+            Segment segment;
+            SegmentRollups rollups;
+            const std::vector<Rollup>* entries;
+            if (index[seg_i].hasSamples())
+            {
+                if (!segment.open(dir + index[seg_i].name) || !segment.isHourly())
+                    continue;
+                mapColumns(segment.labels, mapping);
+                entries = &segment.hours();
+            }
+            else
+            {
+                if (!readRollups(dir + rollupName(index[seg_i].name), rollups))
+                    continue;
+                mapColumns(rollups.labels, mapping);
+                entries = &rollups.days;
+            }
+
+            forEach(samples_from, std::min(chunk_to, index[seg_i].first_ts), addSample);
+            for (const Rollup& entry : *entries)
+            {
+                if (entry.start >= chunk_from && entry.start < chunk_to)
+                    bucket(entry.start).merge(mapRollup(entry, mapping));
+            }
+            samples_from = std::max(samples_from, index[seg_i].last_ts + 1);
+            prev_ts = 0;
+        }
+        forEach(samples_from, chunk_to, addSample);
+    });
+
+    for (std::vector<Rollup>& chunk : chunks)
+        result.insert(result.end(), std::make_move_iterator(chunk.begin()), std::make_move_iterator(chunk.end()));
+    return result;
+}
+
+std::vector<int64_t> DeviceStore::periods(Period period) const
+{
+    // the newest sample may be a day ahead of the catalog for a moment
+    std::vector<int64_t> days, result;
+    if (!readPeriods(dir + "periods", days) || !periodsCover(days, firstTimestamp(index), lastTimestamp()))
+    {
+        collectPeriods(dir, index, period, result);
+        return result;
+    }
+    if (period == PERIOD_DAY)
+        return days;
+
+    // only the first day of every month or year needs a date conversion
+    int64_t next = INT64_MIN;
+    for (int64_t day : days)
+    {
+        if (day < next) continue;
+        result.push_back(periodStart(day, period));
+        next = nextPeriodStart(day, period);
+    }
+    return result;
+}
+
+Rollup DeviceStore::mapRollup(const Rollup& rollup, const std::vector<int>& mapping) const
+{
+    Rollup mapped;
+    mapped.start = rollup.start;
+    mapped.samples = rollup.samples;
+    mapped.sensors.resize(labels.size());
+    for (size_t col = 0; col < mapping.size(); col++)
+    {
+        if (mapping[col] >= 0)
+            mapped.sensors[col] = rollup.sensors[mapping[col]];
+    }
+    return mapped;
+}
+
+void DeviceStore::mapColumns(const std::vector<std::string>& segment_labels, std::vector<int>& mapping) const
+{
+    mapping.assign(labels.size(), -1);
+    for (size_t i = 0; i < labels.size(); i++)
+    {
+        for (size_t col = 0; col < segment_labels.size(); col++)
+        {
+            if (segment_labels[col] == labels[i])
+            {
+                mapping[i] = col;
+                break;
+            }
+        }
+    }
+}
+
+DeviceWriter::~DeviceWriter()
+{
+    close();
+}
+
+bool DeviceWriter::open(const std::string& dir_path)
+{
+    close();
+    dir = dir_path;
+
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+    {
+        std::cerr << "Failed to create " << dir << "\n";
+        return false;
+    }
+
+    std::string index_path = dir + "index";
+    bool index_exists = access(index_path.c_str(), F_OK) == 0;
+    if (!loadIndex(dir, index))
+        return false;
+
+    index_fd = ::open(index_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (index_fd < 0)
+    {
+        std::cerr << "Failed to open " << index_path << "\n";
+        return false;
+    }
+
+    if (!index_exists || lseek(index_fd, 0, SEEK_END) < (off_t)index_header_size)
+    {
+        // write the whole index again, e.g. after rebuilding it from the segments
+        char header[index_header_size];
+        memcpy(header, index_magic, 4);
+        memcpy(header + 4, &index_version, 4);
+        if (ftruncate(index_fd, 0) < 0 || !pwriteAll(index_fd, header, sizeof(header), 0))
+        {
+            close();
+            return false;
+        }
+        for (size_t i = 0; i < index.size(); i++)
+            writeIndexEntry(i);
+    }
+
+    if (index.empty())
+        return openPeriods();
+
+    // reopen the newest segment for appending
+    SegmentInfo& active = index.back();
+    std::string path = dir + active.name;
+    segment_fd = ::open(path.c_str(), O_RDWR | O_APPEND);
+
+    size_t header_size = 0;
+    struct stat st;
+    if (segment_fd < 0 || fstat(segment_fd, &st) < 0 || !readHeader(segment_fd, columns, header_size))
+    {
+        std::cerr << "Invalid segment " << path << ", starting a new one\n";
+        if (segment_fd >= 0)
+            ::close(segment_fd);
+        segment_fd = -1;
+        active.rows = 0;    // whatever the index says, none of its rows are left
+        return openPeriods();
+    }
+
+    // keep the tail aligned if a previous append was interrupted, and bring
+    // the entry up to date if the index write was lost
+    size_t record_size = sizeof(int64_t) + columns.size() * sizeof(float);
+    size_t tail = ((size_t)st.st_size - header_size) % record_size;
+    if (tail != 0 && ftruncate(segment_fd, st.st_size - tail) < 0)
+    {
+        close();
+        return false;
+    }
+
+    active.rows = ((size_t)st.st_size - tail - header_size) / record_size;
+    if (active.rows > 0)
+        readExact(segment_fd, &active.last_ts, sizeof(active.last_ts), st.st_size - tail - record_size);
+    writeIndexEntry(index.size() - 1);
+
+    for (size_t i = index.size(); i-- > 0;)
+    {
+        if (index[i].rows > 0)
+        {
+            has_last = readLastRow(dir + index[i].name, columns, last_ts, last_row);
+            break;
+        }
+    }
+
+    segment_end = nextPeriodStart(active.first_ts, PERIOD_MONTH);
+    return openRollups() && openPeriods();
+}
+
+// Loads the rollups of the active segment, regenerating them if they do not
+// match the samples on disk (e.g. the getter stopped between the two writes)
+bool DeviceWriter::openRollups()
+{
+    const SegmentInfo& active = index.back();
+    std::string path = dir + rollupName(active.name);
+
+    SegmentRollups rollups;
+    if (!readRollups(path, rollups) || rollups.labels != columns || rollups.month.samples != active.rows ||
+        rollups.max_gap != max_energy_gap)
+    {
+        Segment segment;
+        if (!segment.open(dir + active.name))
+            return false;
+        int64_t prev_ts = 0;
+        std::vector<float> prev_values;
+        if (index.size() > 1)
+            readLastRow(dir + index[index.size() - 2].name, columns, prev_ts, prev_values);
+        computeRollups(segment, prev_ts, prev_values, rollups);
+        if (rollups.month.samples == 0)
+            rollups.month.start = periodStart(active.first_ts, PERIOD_MONTH);
+        if (!writeRollups(path, rollups))
+            return false;
+    }
+
+    if (rollup_fd >= 0)
+        ::close(rollup_fd);
+    rollup_fd = ::open(path.c_str(), O_RDWR);
+    if (rollup_fd < 0)
+    {
+        std::cerr << "Failed to open " << path << "\n";
+        return false;
+    }
+
+    rollup_header_size = buildHeader(columns, rollup_magic, rollup_version).size();
+    month_rollup = rollups.month;
+    day_count = rollups.days.size();
+    if (day_count > 0)
+    {
+        day_rollup = rollups.days.back();
+        day_end = nextPeriodStart(day_rollup.start, PERIOD_DAY);
+    }
+    return true;
+}
+
+// Opens the period catalog for appending, writing it again from the
+// segments if it doesn't match them
+bool DeviceWriter::openPeriods()
+{
+    std::string path = dir + "periods";
+    std::vector<int64_t> days;
+    if (!readPeriods(path, days) || !periodsCover(days, firstTimestamp(index), lastTimestamp()))
+    {
+        collectPeriods(dir, index, PERIOD_DAY, days);
+        if (!writePeriods(path, days))
+            return false;
+    }
+
+    if (periods_fd >= 0)
+        ::close(periods_fd);
+    periods_fd = ::open(path.c_str(), O_WRONLY | O_APPEND);
+    if (periods_fd < 0)
+    {
+        std::cerr << "Failed to open " << path << "\n";
+        return false;
+    }
+    last_day = days.empty() ? INT64_MIN : days.back();
+    return true;
+}
+
+bool DeviceWriter::writeRollup(size_t position, const Rollup& rollup)
+{
+    std::string out;
+    encodeRollup(out, rollup);
+    return pwriteAll(rollup_fd, out.data(), out.size(), rollup_header_size + position * out.size());
+}
+
+void DeviceWriter::close()
+{
+    if (segment_fd >= 0)
+        ::close(segment_fd);
+    if (index_fd >= 0)
+        ::close(index_fd);
+    if (rollup_fd >= 0)
+        ::close(rollup_fd);
+    if (periods_fd >= 0)
+        ::close(periods_fd);
+    segment_fd = -1;
+    index_fd = -1;
+    rollup_fd = -1;
+    periods_fd = -1;
+    last_day = INT64_MIN;
+    has_last = false;
+    last_row.clear();
+    day_count = 0;
+    index.clear();
+    columns.clear();
+}
+
+bool DeviceWriter::writeIndexEntry(size_t position)
+{
+    char entry[index_entry_size];
+    encodeIndexEntry(entry, index[position]);
+    return pwriteAll(index_fd, entry, sizeof(entry), index_header_size + position * index_entry_size);
+}
+
+bool DeviceWriter::startSegment(int64_t timestamp, const std::vector<std::string>& labels)
+{
+    if (segment_fd >= 0)
+        ::close(segment_fd);
+
+    SegmentInfo info;
+    info.first_ts = timestamp;
+    info.last_ts = timestamp;
+    info.name = segmentName(timestamp);
+
+    std::string path = dir + info.name;
+    segment_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (segment_fd < 0)
+    {
+        std::cerr << "Failed to create " << path << "\n";
+        return false;
+    }
+
+    last_row = remapRow(columns, last_row, labels);
+    columns = labels;
+    std::string header = buildHeader(columns);
+    if (!writeAll(segment_fd, header.data(), header.size()))
+    {
+        ::close(segment_fd);
+        segment_fd = -1;
+        return false;
+    }
+
+    // an entry with the same name can only be an empty leftover
+    if (!index.empty() && index.back().name == info.name)
+        index.back() = info;
+    else
+        index.push_back(info);
+    segment_end = nextPeriodStart(timestamp, PERIOD_MONTH);
+    if (!writeIndexEntry(index.size() - 1))
+        return false;
+
+    SegmentRollups rollups;
+    rollups.labels = columns;
+    rollups.month.start = periodStart(timestamp, PERIOD_MONTH);
+    rollups.month.sensors.resize(columns.size());
+    return writeRollups(dir + rollupName(info.name), rollups) && openRollups();
+}
+
+// A device that gains a sensor mid-month, or whose first sample of the month
+// was partial: the active segment is rewritten with the new columns at the
+// end, NaN in the rows already there, and swapped in with a rename so readers
+// keep whole files. Readers remap older segments by label as usual.
+bool DeviceWriter::addColumns(const std::vector<std::string>& added)
+{
+    std::string path = dir + index.back().name;
+    std::vector<std::string> wider = columns;
+    wider.insert(wider.end(), added.begin(), added.end());
+
+    Segment segment;
+    SampleBlock rows;
+    if (!segment.open(path))
+        return false;
+    segment.read(0, segment.rowCount(), rows);
+    segment.close();
+
+    std::string out = buildHeader(wider);
+    std::vector<float> row(wider.size(), NAN);
+    for (size_t i = 0; i < rows.rows(); i++)
+    {
+        std::copy(rows.row(i), rows.row(i) + columns.size(), row.begin());
+        encodeRecord(out, rows.timestamps[i], row.data(), row.size());
+    }
+
+    // synced before the rename, the old file may be the only copy of the month
+    std::string tmp_path = tempPath(path);
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0 && writeAll(fd, out.data(), out.size()) && fdatasync(fd) == 0;
+    if (fd >= 0)
+        ::close(fd);
+    if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        std::cerr << "Failed to add sensors to " << path << "\n";
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    ::close(segment_fd);
+    segment_fd = ::open(path.c_str(), O_RDWR | O_APPEND);
+    if (segment_fd < 0)
+    {
+        std::cerr << "Failed to open " << path << "\n";
+        return false;
+    }
+
+    std::cout << "Added";
+    for (const std::string& label : added)
+        std::cout << " \"" << label << "\"";
+    std::cout << " to " << path << std::endl;
+
+    // the rollups no longer match the columns and are recomputed
+    columns = wider;
+    last_row.resize(columns.size(), NAN);
+    return openRollups();
+}
+
+bool DeviceWriter::append(int64_t timestamp, const std::vector<std::string>& labels, const std::vector<float>& values)
+{
+    if (index_fd < 0) return false;
+
+    // history must stay sorted for the binary searches; a clock that went
+    // backwards is clamped to the last stored timestamp
+    if (!index.empty() && index.back().rows > 0 && timestamp < index.back().last_ts)
+        timestamp = index.back().last_ts;
+
+    if (segment_fd < 0 || timestamp >= segment_end)
+    {
+        if (!startSegment(timestamp, labels))
+            return false;
+    }
+
+    std::vector<std::string> added;
+    for (size_t i = 0; i < labels.size() && i < values.size(); i++)
+    {
+        if (std::find(columns.begin(), columns.end(), labels[i]) == columns.end() &&
+            std::find(added.begin(), added.end(), labels[i]) == added.end())
+            added.push_back(labels[i]);
+    }
+    if (!added.empty() && !addColumns(added))
+        return false;
+
+    std::vector<float> row(columns.size(), NAN);
+    for (size_t i = 0; i < labels.size() && i < values.size(); i++)
+    {
+        size_t col = 0;
+        while (col < columns.size() && columns[col] != labels[i])
+            col++;
+        row[col] = values[i];
+    }
+
+    std::string out;
+    encodeRecord(out, timestamp, row.data(), row.size());
+    if (!writeAll(segment_fd, out.data(), out.size()))
+    {
+        std::cerr << "Failed to write " << dir << index.back().name << "\n";
+        return false;
+    }
+
+    SegmentInfo& active = index.back();
+    if (active.rows == 0)
+        active.first_ts = timestamp;
+    active.last_ts = timestamp;
+    active.rows++;
+    if (!writeIndexEntry(index.size() - 1))
+        return false;
+
+    if (day_count == 0 || timestamp >= day_end)
+    {
+        day_count++;
+        day_rollup = Rollup();
+        day_rollup.start = periodStart(timestamp, PERIOD_DAY);
+        day_rollup.sensors.resize(columns.size());
+        day_end = nextPeriodStart(timestamp, PERIOD_DAY);
+    }
+
+    std::vector<double> areas(columns.size());
+    last_row.resize(columns.size(), NAN);
+    integrateInterval(last_row.data(), row.data(), columns.size(), has_last ? timestamp - last_ts : 0, areas.data());
+    day_rollup.add(row.data(), areas.data());
+    month_rollup.add(row.data(), areas.data());
+    last_ts = timestamp;
+    last_row = row;
+    has_last = true;
+
+    if (!writeRollup(day_count, day_rollup) || !writeRollup(0, month_rollup))
+        return false;
+
+    // the catalog only changes with the first sample of a day
+    if (day_rollup.start > last_day)
+    {
+        if (!writeAll(periods_fd, &day_rollup.start, sizeof(day_rollup.start)))
+            return false;
+        last_day = day_rollup.start;
+    }
+    return true;
+}
+
+int64_t DeviceWriter::lastTimestamp() const
+{
+    for (size_t i = index.size(); i-- > 0;)
+    {
+        if (index[i].rows > 0)
+            return index[i].last_ts;
+    }
+    return 0;
+}
+
+bool appendSample(const std::string& ip, int64_t timestamp,
+                  const std::vector<std::string>& labels, const std::vector<float>& values)
+{
+    DeviceWriter writer;
+    return writer.open(deviceDir(ip)) && writer.append(timestamp, labels, values);
+}
+
+void RecentSamples::setCapacity(size_t rows)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    capacity = rows;
+    rings.clear();
+}
+
+void RecentSamples::Ring::push(int64_t timestamp, const float* row)
+{
+    size_t rows = timestamps.size();
+    if (count == rows)
+    {
+        covered_from = timestamps[first] + 1;
+        first = (first + 1) % rows;
+        count--;
+    }
+    size_t slot = (first + count) % rows;
+    timestamps[slot] = timestamp;
+    std::copy(row, row + labels.size(), values.begin() + slot * labels.size());
+    count++;
+}
+
+void RecentSamples::add(const std::string& ip, int64_t timestamp, const std::vector<std::string>& labels,
+                        const std::vector<float>& row)
+{
+    size_t rows;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (capacity == 0) return;
+        auto it = rings.find(ip);
+        if (it != rings.end() && it->second.labels == labels)
+        {
+            it->second.push(timestamp, row.data());
+            return;
+        }
+        rows = capacity;
+    }
+
+    // first row of the device, or its columns changed with a new segment:
+    // start from what the history holds since yesterday, without the lock
+    Ring ring;
+    ring.labels = labels;
+    ring.timestamps.resize(rows);
+    ring.values.resize(rows * labels.size());
+    ring.covered_from = periodStart(periodStart(timestamp, PERIOD_DAY) - 1, PERIOD_DAY);
+
+    DeviceStore store;
+    if (store.open(ip) && store.labels == labels)
+        store.forEach(ring.covered_from, timestamp + 1, [&](int64_t ts, const float* values) { ring.push(ts, values); });
+    else
+        ring.covered_from = timestamp;
+    if (ring.count == 0 || ring.timestamps[(ring.first + ring.count - 1) % rows] != timestamp)
+        ring.push(timestamp, row.data());
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (capacity == rows)
+        rings[ip] = std::move(ring);
+}
+
+bool RecentSamples::read(const std::string& ip, int64_t from, int64_t to, std::vector<std::string>& labels,
+                         SampleBlock& block) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = rings.find(ip);
+    if (it == rings.end() || from < it->second.covered_from)
+        return false;
+
+    const Ring& ring = it->second;
+    size_t sensors = ring.labels.size();
+    size_t rows = ring.timestamps.size();
+    labels = ring.labels;
+    block.sensors = sensors;
+    block.timestamps.clear();
+    block.values.clear();
+    for (size_t i = 0; i < ring.count; i++)
+    {
+        size_t slot = (ring.first + i) % rows;
+        int64_t ts = ring.timestamps[slot];
+        if (ts < from) continue;
+        if (ts >= to) break;
+        block.timestamps.push_back(ts);
+        block.values.insert(block.values.end(), ring.values.begin() + slot * sensors,
+                            ring.values.begin() + (slot + 1) * sensors);
+    }
+    return true;
+}
+
+// Catches records cut short or scribbled over by a crash, not tampering
+static uint32_t fnv1a(const char* data, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+    return hash;
+}
+
+static void putString(std::string& out, const std::string& text)
+{
+    uint16_t len = (uint16_t)std::min<size_t>(text.size(), UINT16_MAX);
+    out.append((const char*)&len, 2);
+    out.append(text, 0, len);
+}
+
+static bool getString(const char*& p, const char* end, std::string& text)
+{
+    uint16_t len;
+    if (end - p < 2) return false;
+    memcpy(&len, p, 2);
+    p += 2;
+    if (end - p < len) return false;
+    text.assign(p, len);
+    p += len;
+    return true;
+}
+
+IngestLog::~IngestLog()
+{
+    close();
+}
+
+bool IngestLog::open(const std::string& path, bool sync_commits)
+{
+    close();
+    sync = sync_commits;
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to open " << path << "\n";
+        return false;
+    }
+
+    struct stat st;
+    char header[log_header_size];
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)log_header_size && readExact(fd, header, sizeof(header), 0) &&
+        memcmp(header, log_magic, 4) == 0 && memcmp(header + 4, &log_version, 4) == 0)
+    {
+        length = st.st_size;
+        return true;
+    }
+
+    if (st.st_size > 0)
+        std::cerr << "Invalid " << path << ", starting a new one\n";
+    memcpy(header, log_magic, 4);
+    memcpy(header + 4, &log_version, 4);
+    if (ftruncate(fd, 0) < 0 || !writeAll(fd, header, sizeof(header)) || fdatasync(fd) < 0)
+    {
+        close();
+        return false;
+    }
+    length = sizeof(header);
+    return true;
+}
+
+void IngestLog::close()
+{
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+    length = 0;
+}
+
+std::vector<DeviceSample> IngestLog::pending() const
+{
+    std::vector<DeviceSample> samples;
+    if (length <= log_header_size) return samples;
+
+    std::string data(length - log_header_size, '\0');
+    if (!readExact(fd, data.data(), data.size(), log_header_size)) return samples;
+
+    const char* p = data.data();
+    const char* end = p + data.size();
+    while (end - p >= (ptrdiff_t)log_record_header_size)
+    {
+        uint32_t size, hash;
+        memcpy(&size, p, 4);
+        memcpy(&hash, p + 4, 4);
+        const char* payload = p + log_record_header_size;
+        if (end - payload < size || fnv1a(payload, size) != hash)
+            break;
+        p = payload + size;
+
+        DeviceSample sample;
+        const char* q = payload;
+        uint16_t sensors;
+        if (!getString(q, p, sample.ip) || p - q < 10)
+            break;
+        memcpy(&sample.timestamp, q, 8);
+        memcpy(&sensors, q + 8, 2);
+        q += 10;
+
+        bool valid = true;
+        sample.labels.resize(sensors);
+        sample.values.resize(sensors);
+        for (uint16_t i = 0; i < sensors && valid; i++)
+        {
+            valid = getString(q, p, sample.labels[i]) && p - q >= 4;
+            if (valid)
+            {
+                memcpy(&sample.values[i], q, 4);
+                q += 4;
+            }
+        }
+        if (!valid)
+            break;
+        samples.push_back(std::move(sample));
+    }
+    return samples;
+}
+
+bool IngestLog::commit(const std::vector<DeviceSample>& samples)
+{
+    if (fd < 0) return false;
+
+    std::string out;
+    std::string payload;
+    for (const DeviceSample& sample : samples)
+    {
+        payload.clear();
+        putString(payload, sample.ip);
+        uint16_t sensors = (uint16_t)std::min(sample.labels.size(), sample.values.size());
+        payload.append((const char*)&sample.timestamp, 8);
+        payload.append((const char*)&sensors, 2);
+        for (uint16_t i = 0; i < sensors; i++)
+        {
+            putString(payload, sample.labels[i]);
+            payload.append((const char*)&sample.values[i], 4);
+        }
+
+        uint32_t size = payload.size();
+        uint32_t hash = fnv1a(payload.data(), payload.size());
+        out.append((const char*)&size, 4);
+        out.append((const char*)&hash, 4);
+        out += payload;
+    }
+
+    if (!writeAll(fd, out.data(), out.size()) || (sync && fdatasync(fd) < 0))
+    {
+        // drop whatever part of the round got in, a torn record would hide
+        // every round appended after it from pending()
+        std::cerr << "Failed to write the ingest log\n";
+        if (ftruncate(fd, length) < 0)
+            std::cerr << "Failed to truncate the ingest log\n";
+        return false;
+    }
+    length += out.size();
+    return true;
+}
+
+bool IngestLog::checkpoint()
+{
+    if (fd < 0) return false;
+    if (syncfs(fd) < 0 || ftruncate(fd, log_header_size) < 0 || fdatasync(fd) < 0)
+    {
+        std::cerr << "Failed to checkpoint the ingest log\n";
+        return false;
+    }
+    length = log_header_size;
+    return true;
+}
+
+// Splits "81.75:graph_Potenza (W)_Energia (Wh)" into value and label
+static void splitField(std::string_view field, std::string_view& value, std::string_view& label)
+{
+    size_t colon = field.find(':');
+    value = field.substr(0, colon);
+    label = colon != std::string_view::npos ? field.substr(colon + 1) : std::string_view();
+}
+
+// Reads the "dd/mm/yyyy;hh:mm;" a text log line starts with
+static bool parseLineTime(std::string_view line, int64_t& ts)
+{
+    if (line.size() < 17 || line[2] != '/' || line[5] != '/' || line[10] != ';' || line[13] != ':' || line[16] != ';')
+        return false;
+
+    auto number = [&](size_t pos, size_t len, int& out)
+    {
+        const char* end = line.data() + pos + len;
+        return std::from_chars(line.data() + pos, end, out).ptr == end;
+    };
+    int day, month, year, hour, minute;
+    if (!number(0, 2, day) || !number(3, 2, month) || !number(6, 4, year) || !number(11, 2, hour) || !number(14, 2, minute))
+        return false;
+
+    ts = makeLocalTime(year, month, day, hour, minute);
+    return true;
+}
+
+// Moves a fully written temporary device directory in place
+static bool commitImport(const std::string& tmp_dir, const std::string& ip)
+{
+    std::string dir = deviceDir(ip);
+    if (std::rename(tmp_dir.substr(0, tmp_dir.size() - 1).c_str(), dir.substr(0, dir.size() - 1).c_str()) != 0)
+    {
+        std::cerr << "Failed to move " << tmp_dir << " to " << dir << "\n";
+        removeDir(tmp_dir);
+        return false;
+    }
+    return true;
+}
+
+long importTextLog(const std::string& ip)
+{
+    MappedFile file;
+    if (!file.open(textLogPath(ip))) return -1;
+
+    if (access(deviceDir(ip).c_str(), F_OK) == 0)
+    {
+        std::cerr << deviceDir(ip) << " already exists\n";
+        return -1;
+    }
+
+    std::string tmp_dir = storage_dir + ip + ".tmp/";
+    removeDir(tmp_dir);
+    DeviceWriter writer;
+    if (!writer.open(tmp_dir))
+        return -1;
+
+    std::vector<std::string> columns;
+    std::vector<std::string_view> fields;
+    std::vector<float> row;
+    std::string_view value, label;
+    long imported = 0;
+    bool first = true;
+
+    // fields of a line have been collected, store it. False on write errors.
+    auto importLine = [&](std::string_view line) -> bool
+    {
+        int64_t ts;
+        if (!parseLineTime(line, ts))
+            return true;
+
+        if (first)
+        {
+            first = false;
+            for (std::string_view field : fields)
+            {
+                splitField(field, value, label);
+                columns.push_back(std::string(label));
+            }
+        }
+        if (columns.empty()) return true;
+
+        row.assign(columns.size(), NAN);
+        for (size_t i = 0; i < fields.size(); i++)
+        {
+            splitField(fields[i], value, label);
+            // unlabeled fields keep their position, labeled ones are matched by
+            // name; sensors rarely move, so look where the header had it first
+            size_t col = i;
+            if (!label.empty() && (col >= columns.size() || columns[col] != label))
+            {
+                col = 0;
+                while (col < columns.size() && columns[col] != label)
+                    col++;
+            }
+            if (col < columns.size())
+                row[col] = parseFloat(value);
+        }
+
+        if (!writer.append(ts, columns, row))
+            return false;
+        imported++;
+        return true;
+    };
+
+    // Lines and fields are views into the mapping, nothing is copied. The
+    // delimiters of a whole chunk are found at once by findDelimiters(), then
+    // every line is cut into fields from that table without looking at its bytes.
+    std::string_view text = file.view();
+    std::vector<uint32_t> offsets;
+    size_t chunk_start = 0;
+    bool ok = true;
+
+    while (ok && chunk_start < text.size())
+    {
+        // chunks end after a newline, unless a single line is longer than a chunk
+        size_t chunk_end = std::min(text.size(), chunk_start + import_chunk_size);
+        if (chunk_end < text.size())
+        {
+            const void* newline = memrchr(text.data() + chunk_start, '\n', chunk_end - chunk_start);
+            if (newline != nullptr)
+                chunk_end = (const char*)newline - text.data() + 1;
+            else
+            {
+                // a tail without any newline, e.g. cut off by a crash, is one last line
+                size_t next = text.find('\n', chunk_end);
+                chunk_end = next == std::string_view::npos ? text.size() : next + 1;
+            }
+        }
+        std::string_view chunk = text.substr(chunk_start, chunk_end - chunk_start);
+        chunk_start = chunk_end;
+
+        offsets.clear();
+        findDelimiters(chunk, '\n', ';', offsets);
+        offsets.push_back(chunk.size());    // ends a last line without newline
+
+        size_t line_start = 0;
+        size_t field_start = 0;
+        fields.clear();
+        for (uint32_t offset : offsets)
+        {
+            if (offset < chunk.size() && chunk[offset] == ';')
+            {
+                // the two in the "dd/mm/yyyy;hh:mm;" prefix don't end fields
+                if (offset >= line_start + 17)
+                    fields.push_back(chunk.substr(field_start, offset - field_start));
+                field_start = offset + 1;
+                continue;
+            }
+
+            std::string_view line = chunk.substr(line_start, offset - line_start);
+            if (!line.empty() && line.back() == '\r')
+                line.remove_suffix(1);
+            // text after the last ';' is a field of its own when there is any
+            size_t line_end = line_start + line.size();
+            if (field_start >= line_start + 17 && line_end > field_start)
+                fields.push_back(chunk.substr(field_start, line_end - field_start));
+            if (!importLine(line))
+            {
+                ok = false;
+                break;
+            }
+            line_start = offset + 1;
+            field_start = line_start;
+            fields.clear();
+        }
+    }
+
+    if (!ok)
+    {
+        writer.close();
+        removeDir(tmp_dir);
+        return -1;
+    }
+
+    writer.close();
+    if (imported == 0 || !commitImport(tmp_dir, ip))
+    {
+        removeDir(tmp_dir);
+        return -1;
+    }
+    return imported;
+}
+
+// Splits a devs/<ip>.snse store from before segments were introduced
+static long migrateLegacyStore(const std::string& ip)
+{
+    Segment legacy;
+    if (!legacy.open(legacyStorePath(ip))) return -1;
+
+    std::string tmp_dir = storage_dir + ip + ".tmp/";
+    removeDir(tmp_dir);
+    DeviceWriter writer;
+    if (!writer.open(tmp_dir))
+        return -1;
+
+    SampleBlock block;
+    std::vector<float> row;
+    size_t next = 0;
+    while (size_t got = legacy.read(next, 4096, block))
+    {
+        for (size_t i = 0; i < got; i++)
+        {
+            row.assign(block.row(i), block.row(i) + block.sensors);
+            if (!writer.append(block.timestamps[i], legacy.labels, row))
+            {
+                writer.close();
+                removeDir(tmp_dir);
+                return -1;
+            }
+        }
+        next += got;
+    }
+
+    writer.close();
+    if (!commitImport(tmp_dir, ip))
+        return -1;
+    std::rename(legacyStorePath(ip).c_str(), (legacyStorePath(ip) + ".old").c_str());
+    return next;
+}
+
+// True if every segment has a rollup file of this version and max gap
+static bool rollupsCurrent(const std::string& ip)
+{
+    std::vector<SegmentInfo> index;
+    if (!loadIndex(deviceDir(ip), index)) return true;
+
+    for (const SegmentInfo& info : index)
+    {
+        SegmentRollups rollups;
+        if (!info.isRaw()) continue;
+        if (!readRollups(deviceDir(ip) + rollupName(info.name), rollups) || rollups.max_gap != max_energy_gap)
+            return false;
+    }
+    return true;
+}
+
+void importIfNeeded(const std::string& ip)
+{
+    struct stat st;
+    if (stat(deviceDir(ip).c_str(), &st) == 0)
+    {
+        if (!rollupsCurrent(ip))
+        {
+            std::cout << "Regenerating rollups of " << ip << "..." << std::endl;
+            rebuildRollups(ip);
+        }
+        return;
+    }
+
+    if (stat(legacyStorePath(ip).c_str(), &st) == 0)
+    {
+        std::cout << "Splitting " << legacyStorePath(ip) << " in segments..." << std::endl;
+        long rows = migrateLegacyStore(ip);
+        if (rows < 0)
+            std::cerr << "Migration of " << legacyStorePath(ip) << " failed\n";
+        else
+            std::cout << "Moved " << rows << " samples into " << deviceDir(ip) << std::endl;
+        return;
+    }
+
+    if (stat(textLogPath(ip).c_str(), &st) != 0) return;
+
+    std::cout << "Importing " << textLogPath(ip) << "..." << std::endl;
+    long rows = importTextLog(ip);
+    if (rows < 0)
+        std::cerr << "Import of " << textLogPath(ip) << " failed\n";
+    else
+        std::cout << "Imported " << rows << " samples into " << deviceDir(ip) << std::endl;
+}
+
+int64_t makeLocalTime(int year, int month, int day, int hour, int minute, int second)
+{
+    std::tm t{};
+    t.tm_year = year - 1900;
+    t.tm_mon = month - 1;
+    t.tm_mday = day;
+    t.tm_hour = hour;
+    t.tm_min = minute;
+    t.tm_sec = second;
+    t.tm_isdst = -1;
+    return (int64_t)std::mktime(&t);
+}
+
+std::tm localTm(int64_t ts)
+{
+    std::time_t t = (std::time_t)ts;
+    std::tm result{};
+    localtime_r(&t, &result);
+    return result;
+}
+
+std::string formatDate(int64_t ts)
+{
+    std::tm t = localTm(ts);
+    char buf[40];
+    snprintf(buf, sizeof(buf), "%02d/%02d/%04d", t.tm_mday, t.tm_mon + 1, t.tm_year + 1900);
+    return buf;
+}
+
+std::string formatMonth(int64_t ts)
+{
+    std::tm t = localTm(ts);
+    char buf[40];
+    snprintf(buf, sizeof(buf), "%02d/%04d", t.tm_mon + 1, t.tm_year + 1900);
+    return buf;
+}
+
+std::string formatYear(int64_t ts)
+{
+    std::tm t = localTm(ts);
+    return std::to_string(t.tm_year + 1900);
+}
+
+std::string formatTime(int64_t ts)
+{
+    std::tm t = localTm(ts);
+    char buf[16];
+    if (t.tm_sec == 0)
+        snprintf(buf, sizeof(buf), "%02d:%02d", t.tm_hour, t.tm_min);
+    else
+        snprintf(buf, sizeof(buf), "%02d:%02d:%02d", t.tm_hour, t.tm_min, t.tm_sec);
+    return buf;
+}
+
+void splitFields(std::string_view text, char delim, std::vector<std::string_view>& fields)
+{
+    fields.clear();
+    size_t start = 0;
+    while (start < text.size())
+    {
+        const char* hit = (const char*)memchr(text.data() + start, delim, text.size() - start);
+        size_t end = hit != nullptr ? hit - text.data() : text.size();
+        fields.push_back(text.substr(start, end - start));
+        start = end + 1;
+    }
+}
+
+SimdLevel simdLevel()
+{
+#ifdef SNSE_X86
+    static const SimdLevel level = __builtin_cpu_supports("avx2") ? SIMD_AVX2 :
+                                   __builtin_cpu_supports("sse2") ? SIMD_SSE2 : SIMD_SCALAR;
+    return level;
+#else
+    return SIMD_SCALAR;
+#endif
+}
+
+static void findDelimitersScalar(const char* data, size_t begin, size_t end, char a, char b,
+                                 std::vector<uint32_t>& offsets)
+{
+    for (size_t i = begin; i < end; i++)
+    {
+        if (data[i] == a || data[i] == b)
+            offsets.push_back(i);
+    }
+}
+
+#ifdef SNSE_X86
+// Every set bit of mask is a delimiter at base + bit
+static inline void pushMask(uint32_t mask, size_t base, std::vector<uint32_t>& offsets)
+{
+    while (mask != 0)
+    {
+        offsets.push_back(base + __builtin_ctz(mask));
+        mask &= mask - 1;
+    }
+}
+
+__attribute__((target("sse2")))
+static size_t findDelimitersSse2(const char* data, size_t size, char a, char b, std::vector<uint32_t>& offsets)
+{
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb));
+        pushMask(_mm_movemask_epi8(hits), i, offsets);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t findDelimitersAvx2(const char* data, size_t size, char a, char b, std::vector<uint32_t>& offsets)
+{
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i hits = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, va), _mm256_cmpeq_epi8(chunk, vb));
+        pushMask(_mm256_movemask_epi8(hits), i, offsets);
+    }
+    return i;
+}
+#endif
+
+void findDelimiters(std::string_view data, char a, char b, std::vector<uint32_t>& offsets, SimdLevel level)
+{
+    size_t done = 0;
+#ifdef SNSE_X86
+    if (level == SIMD_AVX2)
+        done = findDelimitersAvx2(data.data(), data.size(), a, b, offsets);
+    else if (level == SIMD_SSE2)
+        done = findDelimitersSse2(data.data(), data.size(), a, b, offsets);
+#endif
+    // the tail shorter than a vector, or everything without SIMD
+    findDelimitersScalar(data.data(), done, data.size(), a, b, offsets);
+}
+
+float parseFloat(std::string_view text)
+{
+    size_t skip = 0;
+    while (skip < text.size() && (text[skip] == ' ' || text[skip] == '+'))
+        skip++;
+
+    float value;
+    const char* first = text.data() + skip;
+    if (std::from_chars(first, text.data() + text.size(), value).ptr == first)
+        return NAN;
+    return value;
+}
+
+std::string formatValue(float value)
+{
+    if (std::isnan(value)) return "nan";
+    // never in exponent notation, clients keep only the digits, '.' and '-';
+    // the longest float, -3.4e38 in full, takes 40 characters
+    char buf[64];
+    std::to_chars_result res = std::to_chars(buf, buf + sizeof(buf), value, std::chars_format::fixed);
+    return std::string(buf, res.ptr);
+}
+
+bool parseDayRange(const std::string& day, int64_t& from, int64_t& to)
+{
+    int d, m, y;
+    if (day.size() != 10 || sscanf(day.c_str(), "%2d/%2d/%4d", &d, &m, &y) != 3)
+        return false;
+    from = makeLocalTime(y, m, d);
+    to = makeLocalTime(y, m, d + 1);
+    return true;
+}
+
+bool parseMonthRange(const std::string& month, int64_t& from, int64_t& to)
+{
+    int m, y;
+    if (month.size() != 7 || sscanf(month.c_str(), "%2d/%4d", &m, &y) != 2)
+        return false;
+    from = makeLocalTime(y, m, 1);
+    to = makeLocalTime(y, m + 1, 1);
+    return true;
+}
+
+bool parseYearRange(const std::string& year, int64_t& from, int64_t& to)
+{
+    int y;
+    if (year.size() != 4 || sscanf(year.c_str(), "%4d", &y) != 1)
+        return false;
+    from = makeLocalTime(y, 1, 1);
+    to = makeLocalTime(y + 1, 1, 1);
+    return true;
+}
+
+int64_t periodStart(int64_t ts, Period period)
+{
+    std::tm t = localTm(ts);
+    int year = t.tm_year + 1900;
+
+    if (period == PERIOD_DAY)
+        return makeLocalTime(year, t.tm_mon + 1, t.tm_mday);
+    if (period == PERIOD_MONTH)
+        return makeLocalTime(year, t.tm_mon + 1, 1);
+    return makeLocalTime(year, 1, 1);
+}
+
+int64_t nextPeriodStart(int64_t ts, Period period)
+{
+    std::tm t = localTm(ts);
+    int year = t.tm_year + 1900;
+    int month = t.tm_mon + 1;
+
+    if (period == PERIOD_DAY)
+        return makeLocalTime(year, month, t.tm_mday + 1);
+    if (period == PERIOD_MONTH)
+        return makeLocalTime(year, month + 1, 1);
+    return makeLocalTime(year + 1, 1, 1);
+}
+
+std::string formatPeriod(int64_t ts, Period period)
+{
+    if (period == PERIOD_DAY)
+        return formatDate(ts);
+    if (period == PERIOD_MONTH)
+        return formatMonth(ts);
+    return formatYear(ts);
+}
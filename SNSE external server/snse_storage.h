@@ -0,0 +1,588 @@
+#ifndef SNSE_STORAGE_H
+#define SNSE_STORAGE_H
+
+#include <cstdint>
+#include <cmath>
+#include <ctime>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <mutex>
+
+// Binary per-device history, split in one segment file per month:
+//   devs/<ip>/2025-09.snse, devs/<ip>/2025-10.snse, ...
+//   devs/<ip>/index
+//
+// Segment header (native byte order):
+//   "SNSE" magic, u32 version, u32 sensor count, u32 header size,
+//   then for every sensor: u16 label length + label bytes
+//   (e.g. "graph_Potenza (W)_Energia (Wh)", empty if the sensor had no marker)
+// Segment records, fixed width, appended in time order:
+//   i64 epoch timestamp (seconds) + one f32 per sensor
+//
+// Every column sits at a fixed offset in the record, so a row can be located
+// by index and the timestamp column can be binary searched without parsing.
+//
+// A month is compressed by the server's compaction once the next one starts,
+// under the same name:
+//   header like a segment ("SNSZ" magic), u64 rows, u32 rows per block,
+//   u32 block count, per block i64 first timestamp + u64 file offset,
+//   then the blocks
+// A block is a bit stream that decodes on its own: the timestamps as
+// delta-of-deltas after a raw first one, then each sensor's values XORed with
+// the previous one (Gorilla encoding). Readers binary search the block
+// timestamps and only decode the blocks a query touches.
+//
+// The index is a sidecar with one fixed-size entry per segment (first and
+// last timestamp, row count, file name), so a range query only opens the
+// segments that overlap it. The last segment is the one being appended to:
+// its entry may lag behind the file by a row, so readers treat it as open-ended.
+//
+// Every segment has a rollup sidecar, devs/<ip>/2025-09.roll, kept up to date
+// by the writer so month and year views never touch the raw samples:
+//   header like a segment ("SNSR" magic) with the segment's labels
+//   entry 0 covers the whole month, entries 1... one day each, in order
+// Entry: i64 period start, u32 samples, u32 max gap (seconds), then per sensor
+//   f64 sum, f64 energy, f32 min, f32 max, u32 count, u32 reserved
+// Energy is the trapezoid integral of the value over hours between each sample
+// and the one before it (even across a day or segment boundary). Intervals
+// longer than the max gap are holes in the data and add nothing.
+//
+// With a retention policy, months older than the raw limit keep hourly
+// aggregates in 2025-09.hour.snse and later only their rollups; the index
+// entry is renamed to match. The hourly file is
+//   header like a segment ("SNSH" magic), then one rollup entry as above for
+//   every local hour with samples, in order
+// Read as a segment it has one row per hour, the means stamped with the hour
+// start; stepped aggregations and rollups use the whole entries instead.
+// A month left with only its rollups has no rows at all; stepped aggregations
+// take its day entries, each into the bucket its midnight falls in.
+//
+// devs/<ip>/periods lists the local days that have samples, so the day, month
+// and year listings don't depend on how long the history is:
+//   "SNSP" magic, u32 version, then one i64 day start per day, ascending
+// The writer appends a day with its first sample and rewrites the file when
+// it doesn't run from the day of the oldest sample to that of the newest.
+//
+// The getter first appends every round of samples to devs/ingest.wal and
+// syncs it, then writes the segments without syncing them:
+//   "SNSW" magic, u32 version, then per record:
+//   u32 payload size, u32 FNV-1a hash of the payload, payload:
+//   u16 ip length + ip, i64 timestamp, u16 sensor count,
+//   per sensor u16 label length + label, f32 value
+// At startup the records newer than a device's last stored sample are
+// appended again, everything is synced and the log is emptied.
+
+const uint32_t storage_version = 1;
+const uint32_t compressed_version = 1;
+const uint32_t hourly_version = 1;
+const uint32_t index_version = 1;
+const uint32_t rollup_version = 2;
+const uint32_t periods_version = 1;
+const std::string storage_dir = "devs/";
+
+// Longest interval between two samples that is integrated into energies, in
+// seconds. Rollups store the value they were computed with; the getter
+// regenerates them when it is started with a different one.
+const int64_t default_max_energy_gap = 15 * 60;
+extern int64_t max_energy_gap;
+
+// Threads a single aggregation over raw samples may use, the calling one
+// included. Months and chunks of the range are split between them; rollups
+// read from disk are too cheap to be worth it.
+extern unsigned aggregation_threads;
+
+// Local time helpers shared by the getter and the comm server
+int64_t makeLocalTime(int year, int month, int day, int hour = 0, int minute = 0, int second = 0);
+std::tm localTm(int64_t ts);
+std::string formatDate(int64_t ts);        // dd/mm/yyyy
+std::string formatMonth(int64_t ts);       // mm/yyyy
+std::string formatYear(int64_t ts);        // yyyy
+std::string formatTime(int64_t ts);        // hh:mm, or hh:mm:ss for sub-minute samples
+std::string formatValue(float value);      // shortest decimal that reads back the same, no exponent ("239", "0.00001")
+
+// Splits text on delim in a single pass. The fields are views into text and
+// the vector is reused, so parsing a stream of rows doesn't allocate. Text
+// after the last delimiter is a field only if it is not empty ("a;b;" gives
+// two fields).
+void splitFields(std::string_view text, char delim, std::vector<std::string_view>& fields);
+
+// The number text starts with, after any spaces ("81.75 W" gives 81.75), or NaN
+float parseFloat(std::string_view text);
+
+enum SimdLevel
+{
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2
+};
+
+// Best instruction set the CPU running us supports
+SimdLevel simdLevel();
+
+// Appends to offsets the position of every byte of data that equals a or b,
+// in order, comparing 16 or 32 bytes at a time when the CPU allows it.
+// data must be shorter than 4 GiB.
+void findDelimiters(std::string_view data, char a, char b, std::vector<uint32_t>& offsets,
+                    SimdLevel level = simdLevel());
+
+enum Period
+{
+    PERIOD_DAY,
+    PERIOD_MONTH,
+    PERIOD_YEAR
+};
+
+// Start of the day/month/year containing ts, and of the one following it
+int64_t periodStart(int64_t ts, Period period);
+int64_t nextPeriodStart(int64_t ts, Period period);
+std::string formatPeriod(int64_t ts, Period period);
+
+// Parse "dd/mm/yyyy", "mm/yyyy" and "yyyy" into [from, to) epoch ranges
+bool parseDayRange(const std::string& day, int64_t& from, int64_t& to);
+bool parseMonthRange(const std::string& month, int64_t& from, int64_t& to);
+bool parseYearRange(const std::string& year, int64_t& from, int64_t& to);
+
+// A run of rows read from a segment: timestamps[i] goes with
+// values[i * sensors ... i * sensors + sensors - 1]
+struct SampleBlock
+{
+    std::vector<int64_t> timestamps;
+    std::vector<float> values;
+    size_t sensors = 0;
+
+    size_t rows() const { return timestamps.size(); }
+    const float* row(size_t i) const { return values.data() + i * sensors; }
+};
+
+struct SegmentInfo
+{
+    int64_t first_ts = 0;
+    int64_t last_ts = 0;
+    uint64_t rows = 0;
+    std::string name;       // file name inside the device directory
+
+    // Retention replaces old raw months by hourly aggregates (2025-09.hour.snse),
+    // later drops those too and keeps only the rollups (named 2025-09.roll)
+    bool hasSamples() const { return name.size() < 5 || name.compare(name.size() - 5, 5, ".roll") != 0; }
+    bool isRaw() const { return hasSamples() && name.find(".hour.") == std::string::npos; }
+};
+
+// Aggregates of one sensor over a day or a month. NaN samples are not counted.
+struct SensorRollup
+{
+    double sum = 0.0;
+    double energy = 0.0;    // value integrated over hours, see the file header
+    float min = NAN;
+    float max = NAN;
+    uint32_t count = 0;
+};
+
+struct Rollup
+{
+    int64_t start = 0;
+    uint32_t samples = 0;
+    std::vector<SensorRollup> sensors;
+
+    // areas holds each sensor's energy since the previous sample, see integrateInterval()
+    void add(const float* values, const double* areas);
+
+    // Adds the samples of another rollup of the same sensors
+    void merge(const Rollup& other);
+};
+
+// Trapezoid area of every sensor between two samples dt seconds apart, into
+// areas. Zero if dt exceeds max_energy_gap or either value is NaN.
+void integrateInterval(const float* prev, const float* values, size_t sensors, int64_t dt, double* areas);
+
+// Month and day rollups of one segment
+struct SegmentRollups
+{
+    std::vector<std::string> labels;
+    int64_t max_gap = 0;
+    Rollup month;
+    std::vector<Rollup> days;
+};
+
+// Read-only mapping of a whole file
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+
+    bool open(const std::string& path);
+    void close();
+
+    // Maps data appended since open(). Returns true if the file grew.
+    bool remap();
+
+    int descriptor() const { return fd; }
+    const char* data() const { return map; }
+    size_t size() const { return length; }
+    std::string_view view() const { return std::string_view(map, length); }
+
+private:
+    int fd = -1;
+    char* map = nullptr;
+    size_t length = 0;
+};
+
+// One segment file, read-only. Rows are read straight from a mapping of the file.
+class Segment
+{
+public:
+    Segment() = default;
+    Segment(const Segment&) = delete;
+    Segment& operator=(const Segment&) = delete;
+    ~Segment();
+
+    // Returns false if missing or not a segment
+    bool open(const std::string& path);
+    void close();
+
+    size_t sensorCount() const { return labels.size(); }
+    size_t rowCount() const { return rows; }
+    int64_t timestampAt(size_t row) const;
+
+    // First row with timestamp >= ts (rowCount() if none)
+    size_t lowerBound(int64_t ts) const;
+
+    // Reads up to max_rows rows starting at first_row, replacing block contents.
+    // Returns the number of rows read.
+    size_t read(size_t first_row, size_t max_rows, SampleBlock& block) const;
+
+    // Picks up rows appended since open(). Returns true if there are new ones.
+    bool refresh();
+
+    bool isCompressed() const { return compressed; }
+    bool isHourly() const { return hourly; }
+
+    // The hour aggregates of an hourly segment, rows() are their means
+    const std::vector<Rollup>& hours() const { return hour_rollups; }
+
+    std::vector<std::string> labels;
+
+private:
+    // Decodes block b of a compressed segment into decoded, unless it is there
+    void decodeBlock(size_t b) const;
+    int64_t blockTimestamp(size_t b) const;
+
+    MappedFile file;
+    size_t header_size = 0;
+    size_t record_size = 0;
+    size_t rows = 0;
+
+    bool compressed = false;
+    size_t block_rows = 0;
+    size_t blocks = 0;
+    const char* directory = nullptr;
+    mutable size_t decoded_block = SIZE_MAX;
+
+    // an hourly segment is small and kept whole in decoded
+    bool hourly = false;
+    std::vector<Rollup> hour_rollups;
+    mutable SampleBlock decoded;
+};
+
+// All segments of one device, read-only
+class DeviceStore
+{
+public:
+    // Loads devs/<ip>/index. Returns false if the device has no history.
+    bool open(const std::string& ip);
+
+    // Columns of the newest segment. Rows of older segments with a different
+    // sensor set are remapped by label, missing sensors read as NaN.
+    std::vector<std::string> labels;
+
+    size_t sensorCount() const { return labels.size(); }
+    const std::vector<SegmentInfo>& segments() const { return index; }
+    size_t rowCount() const;
+    int64_t timestampAt(size_t row) const;
+
+    // Timestamp of the newest sample on disk, which the index may not list
+    // yet. 0 if there is none.
+    int64_t lastTimestamp() const;
+
+    // Segments overlapping [from, to), as [first, last) positions in segments()
+    void overlapping(int64_t from, int64_t to, size_t& first, size_t& last) const;
+
+    // Day or month rollups starting in [from, to), in the store's columns.
+    // Segments without a usable rollup file are aggregated from raw samples.
+    std::vector<Rollup> rollups(int64_t from, int64_t to, Period period) const;
+
+    // Aggregates [from, to) in buckets of step seconds starting at from,
+    // leaving out empty ones. Whole days from a local midnight to another are
+    // summed from the day rollups (bucket starts follow DST), anything else is
+    // aggregated from the raw samples in one pass. Months past retention add
+    // their hour aggregates or day rollups whole, see the storage header.
+    std::vector<Rollup> aggregate(int64_t from, int64_t to, int64_t step) const;
+
+    // Starts of the days, months or years that have samples, oldest first.
+    // Read from the period catalog, or found in the segments if it is behind.
+    std::vector<int64_t> periods(Period period) const;
+
+    // Calls fn(timestamp, const float* values) for every row with from <= ts < to
+    template <typename F>
+    void forEach(int64_t from, int64_t to, F fn) const
+    {
+        size_t first, last;
+        overlapping(from, to, first, last);
+
+        SampleBlock block;
+        std::vector<int> mapping;
+        std::vector<float> remapped(labels.size());
+
+        for (size_t seg_i = first; seg_i < last; seg_i++)
+        {
+            Segment segment;
+            if (!index[seg_i].hasSamples() || !segment.open(dir + index[seg_i].name)) continue;
+
+            bool same_columns = segment.labels == labels;
+            if (!same_columns)
+                mapColumns(segment.labels, mapping);
+
+            size_t row = segment.lowerBound(from);
+            while (true)
+            {
+                // the newest segment may have grown while it was read
+                if (row >= segment.rowCount() && (seg_i + 1 < index.size() || !segment.refresh()))
+                    break;
+
+                size_t got = segment.read(row, 4096, block);
+                if (got == 0) break;
+                for (size_t i = 0; i < got; i++)
+                {
+                    if (block.timestamps[i] >= to) return;
+                    if (same_columns)
+                    {
+                        fn(block.timestamps[i], block.row(i));
+                        continue;
+                    }
+                    for (size_t col = 0; col < mapping.size(); col++)
+                        remapped[col] = mapping[col] < 0 ? NAN : block.row(i)[mapping[col]];
+                    fn(block.timestamps[i], (const float*)remapped.data());
+                }
+                row += got;
+            }
+        }
+    }
+
+private:
+    // mapping[i] is the column of labels[i] in segment_labels, or -1
+    void mapColumns(const std::vector<std::string>& segment_labels, std::vector<int>& mapping) const;
+
+    // rollup with the sensors in the store's columns, by a mapColumns() mapping
+    Rollup mapRollup(const Rollup& rollup, const std::vector<int>& mapping) const;
+
+    std::string dir;
+    std::vector<SegmentInfo> index;
+};
+
+// Appends samples to a device directory, starting a new segment every month.
+// Keeps the active segment and the index open between appends.
+class DeviceWriter
+{
+public:
+    DeviceWriter() = default;
+    DeviceWriter(const DeviceWriter&) = delete;
+    DeviceWriter& operator=(const DeviceWriter&) = delete;
+    ~DeviceWriter();
+
+    // dir must end with '/', it is created if missing
+    bool open(const std::string& dir);
+    void close();
+
+    // Values are matched to the segment columns by label; missing sensors are
+    // stored as NaN. A sensor the segment has no column for yet widens it, see
+    // addColumns().
+    bool append(int64_t timestamp, const std::vector<std::string>& labels, const std::vector<float>& values);
+
+    bool isOpen() const { return index_fd >= 0; }
+
+    // Newest stored sample, 0 if there is none
+    int64_t lastTimestamp() const;
+
+    // The columns of the active segment and the last appended row in them
+    const std::vector<std::string>& labels() const { return columns; }
+    const std::vector<float>& lastRow() const { return last_row; }
+
+private:
+    bool startSegment(int64_t timestamp, const std::vector<std::string>& labels);
+    bool addColumns(const std::vector<std::string>& added);
+    bool writeIndexEntry(size_t position);
+    bool openRollups();
+    bool writeRollup(size_t position, const Rollup& rollup);
+    bool openPeriods();
+
+    std::string dir;
+    int segment_fd = -1;
+    int index_fd = -1;
+    int rollup_fd = -1;
+    int periods_fd = -1;
+    size_t rollup_header_size = 0;
+    std::vector<SegmentInfo> index;
+    std::vector<std::string> columns;
+    int64_t segment_end = 0;        // first timestamp that belongs to the next segment
+    int64_t last_ts = 0;            // last appended sample, for the energy integral
+    std::vector<float> last_row;    // its values, in columns
+    bool has_last = false;
+
+    // rollups of the active segment; the current day is entry day_count
+    Rollup month_rollup;
+    Rollup day_rollup;
+    size_t day_count = 0;
+    int64_t day_end = 0;
+    int64_t last_day = INT64_MIN;   // newest day in the period catalog
+};
+
+std::string deviceDir(const std::string& ip);
+std::string textLogPath(const std::string& ip);
+std::string segmentName(int64_t ts);     // 2025-09.snse
+std::string rollupName(const std::string& segment_name);    // 2025-09.roll
+
+// Aggregates a segment into month and day rollups. prev_ts and prev_values are
+// the last sample before the segment, in its columns (0 and empty if none), so
+// the first energy interval is known.
+void computeRollups(const Segment& segment, int64_t prev_ts, const std::vector<float>& prev_values,
+                    SegmentRollups& rollups);
+bool readRollups(const std::string& path, SegmentRollups& rollups);
+bool writeRollups(const std::string& path, const SegmentRollups& rollups);
+
+// Regenerates every rollup file of a device from its raw segments.
+// Must not run while the getter is appending to the same device.
+bool rebuildRollups(const std::string& ip);
+
+// How long each resolution of the history is kept, 0 for ever. A month moves
+// down a tier as a whole, once its end is older than the limit.
+struct RetentionPolicy
+{
+    int raw_days = 0;           // then hourly aggregates
+    int hourly_months = 0;      // then only the day and month rollups
+};
+
+// Applies the policy to the sealed months of a device, swapping files with
+// renames and rewriting their index entries. Files that were replaced are
+// deleted on the next call, so readers that loaded the index before still
+// find them. Safe while the getter appends to the device.
+bool applyRetention(const std::string& ip, const RetentionPolicy& policy, int64_t now);
+
+// Rewrites a sealed segment in the compressed format. The new file is synced
+// and checked to decode to the same rows before it replaces the old one.
+bool compressSegment(const std::string& path);
+
+// Compresses every segment of a device but the one being appended to.
+// Returns how many were compressed, -1 if the device has no history.
+long compressHistory(const std::string& ip);
+
+// One compaction pass over the sealed months of a device: compresses the raw
+// segments and repairs rollups that no longer match their samples, each with
+// a rename swap so queries keep reading whole files. pace is called with the
+// size of a segment before each pass over it, for the caller to throttle the I/O.
+// Also removes temporary files left by rewrites that died half way.
+bool compactDevice(const std::string& ip, const std::function<void(size_t)>& pace);
+
+// Reads devs/<ip>/index, rebuilding it from the segment files if it is missing
+bool loadIndex(const std::string& dir, std::vector<SegmentInfo>& index);
+bool rebuildIndex(const std::string& dir, std::vector<SegmentInfo>& index);
+
+// Appends one sample, creating the device directory if needed
+bool appendSample(const std::string& ip, int64_t timestamp,
+                  const std::vector<std::string>& labels, const std::vector<float>& values);
+
+// The last two days of every device, kept in memory when the getter and the
+// server run in one process (snse_daemon) so that queries about today or
+// yesterday don't read the disk. The getter adds every row it stores; a
+// device is loaded from its history the first time. Thread safe.
+class RecentSamples
+{
+public:
+    // Rows kept per device, enough for two days at the sampling interval
+    void setCapacity(size_t rows);
+
+    // After the getter appended a row, in the columns it was stored with
+    void add(const std::string& ip, int64_t timestamp, const std::vector<std::string>& labels,
+             const std::vector<float>& row);
+
+    // Copies the rows with from <= ts < to and their labels. False if the
+    // range isn't all in memory, then the history on disk has to be read.
+    bool read(const std::string& ip, int64_t from, int64_t to, std::vector<std::string>& labels,
+              SampleBlock& block) const;
+
+private:
+    // A circular buffer holding every row from covered_from on
+    struct Ring
+    {
+        std::vector<std::string> labels;
+        std::vector<int64_t> timestamps;
+        std::vector<float> values;
+        size_t first = 0;
+        size_t count = 0;
+        int64_t covered_from = 0;
+
+        void push(int64_t timestamp, const float* row);
+    };
+
+    mutable std::mutex mutex;
+    size_t capacity = 0;
+    std::unordered_map<std::string, Ring> rings;
+};
+
+// A sample as the getter received it
+struct DeviceSample
+{
+    std::string ip;
+    int64_t timestamp = 0;
+    std::vector<std::string> labels;
+    std::vector<float> values;
+};
+
+// Write-ahead log of the samples of each round, see the file header
+class IngestLog
+{
+public:
+    IngestLog() = default;
+    IngestLog(const IngestLog&) = delete;
+    IngestLog& operator=(const IngestLog&) = delete;
+    ~IngestLog();
+
+    // sync: fdatasync() every commit; without it the log only protects
+    // against the getter dying, not the machine
+    bool open(const std::string& path, bool sync);
+    void close();
+
+    // Records left by a previous run, oldest first; stops at a torn record
+    std::vector<DeviceSample> pending() const;
+
+    // Appends a round with a single write, then syncs it. On failure the log
+    // is cut back to what it held before.
+    bool commit(const std::vector<DeviceSample>& samples);
+
+    // Flushes the file system holding the log and empties it: everything
+    // written before is on disk
+    bool checkpoint();
+
+    size_t size() const { return length; }
+
+private:
+    int fd = -1;
+    bool sync = true;
+    size_t length = 0;
+};
+
+// Converts devs/<ip>.txt (dd/mm/yyyy;hh:mm;value:graph_label;...) into
+// segments. The text file is left untouched.
+// Returns the number of imported rows, or -1 on failure.
+long importTextLog(const std::string& ip);
+
+// Imports devs/<ip>.txt, or splits a single-file devs/<ip>.snse store into
+// segments, if the device has no segment directory yet. Rollups left by an
+// older version or computed with another max_energy_gap are regenerated.
+void importIfNeeded(const std::string& ip);
+
+#endif
@@ -0,0 +1,52 @@
+// Aggregation from raw samples split across 1, 2, 4 and 8 threads: the month
+// totals of a year whose rollup files are missing, and the whole history in
+// hourly steps. A sample every 10 s of four sensors, compressed as the server's
+// compaction leaves it. Usage: bench_aggregate [months, default 12]
+#include "bench_util.h"
+#include "test_util.h"
+
+#include <cstdlib>
+#include <thread>
+#include <unistd.h>
+
+int main(int argc, char** argv)
+{
+    int months = argc > 1 ? atoi(argv[1]) : 12;
+    enterScratchDir();
+    const char* ip = "10.0.0.1";
+    std::string dir = deviceDir(ip);
+    int64_t start = makeLocalTime(2022, 1, 1);
+    int64_t end = makeLocalTime(2022, 1 + months, 1);
+    {
+        DeviceWriter writer;
+        if (!writer.open(dir))
+            return 1;
+        std::vector<std::string> labels = { "P", "V", "I", "S" };
+        for (int64_t ts = start; ts <= end; ts += 10)
+        {
+            float x = (float)(ts / 10 % 1000);
+            writer.append(ts, labels, { x, 230.0f + ts % 7, x / 230, 1.0f });
+        }
+    }
+    compressHistory(ip);
+
+    // without rollups every month is aggregated from its samples
+    std::vector<SegmentInfo> index;
+    loadIndex(dir, index);
+    for (const SegmentInfo& info : index)
+        unlink((dir + info.name.substr(0, info.name.rfind('.')) + ".roll").c_str());
+
+    DeviceStore store;
+    if (!store.open(ip))
+        return 1;
+    printf("%u cores\n", std::thread::hardware_concurrency());
+    for (unsigned threads : { 1u, 2u, 4u, 8u })
+    {
+        aggregation_threads = threads;
+        double year = best(3, [&] { store.rollups(start, end, PERIOD_MONTH); });
+        double hourly = best(3, [&] { store.aggregate(start, end, 3600); });
+        printf("%u threads   month totals from raw %7.1f ms   hourly steps %7.1f ms\n", threads, year * 1000,
+               hourly * 1000);
+    }
+    return 0;
+}
@@ -0,0 +1,108 @@
+// Many clients loading graphs from a running snse_server at once: each one
+// asks for the list of days of a device and then the newest day, over its own
+// connection. Usage: bench_clients <device ip> [clients, default 64] [loads per client, default 20]
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+// Sends one request and reads its answer, which ends with "\r\n"
+static bool request(int fd, const std::string& line, std::string& answer)
+{
+    std::string text = line + "\r\n";
+    if (send(fd, text.data(), text.size(), MSG_NOSIGNAL) != (ssize_t)text.size())
+        return false;
+    answer.clear();
+    char buf[65536];
+    while (answer.size() < 2 || answer.compare(answer.size() - 2, 2, "\r\n") != 0)
+    {
+        ssize_t got = recv(fd, buf, sizeof(buf), 0);
+        if (got <= 0)
+            return false;
+        answer.append(buf, got);
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <device ip> [clients] [loads per client]\n", argv[0]);
+        return 2;
+    }
+    std::string ip = argv[1];
+    int clients = argc > 2 ? atoi(argv[2]) : 64;
+    int loads = argc > 3 ? atoi(argv[3]) : 20;
+
+    std::mutex lock;
+    std::vector<double> latencies;
+    std::atomic<int> errors{0};
+    Clock::time_point start = Clock::now();
+
+    std::vector<std::thread> threads;
+    for (int c = 0; c < clients; c++)
+    {
+        threads.emplace_back([&]
+        {
+            sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(34678);
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0)
+            {
+                errors++;
+                if (fd >= 0) close(fd);
+                return;
+            }
+
+            std::string days, data;
+            for (int i = 0; i < loads; i++)
+            {
+                Clock::time_point begin = Clock::now();
+                if (!request(fd, "GET ?dev=" + ip + "&time=days", days) || days.compare(0, 3, "200") != 0)
+                {
+                    errors++;
+                    break;
+                }
+                // the newest day is the last line of the list
+                days.resize(days.size() - 2);
+                std::string newest = days.substr(days.rfind('\n') + 1);
+                if (!request(fd, "GET ?dev=" + ip + "&time=days&data=" + newest, data) || data.compare(0, 3, "200") != 0)
+                {
+                    errors++;
+                    break;
+                }
+                std::lock_guard<std::mutex> guard(lock);
+                latencies.push_back(std::chrono::duration<double>(Clock::now() - begin).count());
+            }
+            close(fd);
+        });
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+
+    double total = std::chrono::duration<double>(Clock::now() - start).count();
+    std::sort(latencies.begin(), latencies.end());
+    if (latencies.empty())
+    {
+        printf("no graph loaded, %d errors\n", errors.load());
+        return 1;
+    }
+    printf("%d clients x %d graph loads: %zu ok, %d errors, %.2f s, %.0f loads/s, p50 %.1f ms, p99 %.1f ms\n",
+           clients, loads, latencies.size(), errors.load(), total, latencies.size() / total,
+           latencies[latencies.size() / 2] * 1000, latencies[latencies.size() * 99 / 100] * 1000);
+    return errors == 0 ? 0 : 1;
+}
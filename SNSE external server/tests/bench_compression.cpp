@@ -0,0 +1,79 @@
+// Size and decode speed of a device history as a text log, as raw segments
+// and as compressed segments: 5-minute samples of two sensors, imported from
+// the generated log and then compressed. Usage: bench_compression [days, default 3650]
+#include "bench_util.h"
+#include "test_util.h"
+
+#include <fstream>
+#include <vector>
+
+static double parseText(const std::string& text, size_t& rows)
+{
+    std::vector<std::string_view> lines, fields;
+    double sum = 0;
+    double time = best(5, [&]
+    {
+        splitFields(text, '\n', lines);
+        for (std::string_view line : lines)
+        {
+            splitFields(line.substr(17), ';', fields);
+            for (std::string_view field : fields)
+                sum += parseFloat(field.substr(0, field.find(':')));
+        }
+        rows = lines.size();
+    });
+    return sum == 42 ? 0 : time;
+}
+
+static void scan(const char* name, const std::string& dir, const std::vector<SegmentInfo>& index)
+{
+    size_t bytes = 0, rows = 0;
+    double sum = 0;
+    for (const SegmentInfo& info : index)
+        bytes += fileSize(dir + info.name);
+    double time = best(5, [&]
+    {
+        SampleBlock block;
+        rows = 0;
+        for (const SegmentInfo& info : index)
+        {
+            Segment segment;
+            segment.open(dir + info.name);
+            for (size_t row = 0; size_t got = segment.read(row, 4096, block); row += got)
+            {
+                rows += got;
+                sum += block.values[0];
+            }
+        }
+    });
+    printf("%-11s %6.2f bytes/row  %7.1f M rows/s decoded%s\n", name, (double)bytes / rows, rows / time / 1e6,
+           sum == 42 ? " " : "");
+}
+
+int main(int argc, char** argv)
+{
+    int days = argc > 1 ? atoi(argv[1]) : 3650;
+    enterScratchDir();
+    const char* ip = "10.0.0.1";
+    std::string text = textLog(days, 300, 2);
+    std::ofstream(textLogPath(ip), std::ios::binary) << text;
+
+    size_t rows = 0;
+    double time = parseText(text, rows);
+    printf("%-11s %6.2f bytes/row  %7.1f M rows/s parsed\n", "text lines", (double)text.size() / rows,
+           rows / time / 1e6);
+
+    if (importTextLog(ip) <= 0)
+        return 1;
+    std::string dir = deviceDir(ip);
+    std::vector<SegmentInfo> index;
+    loadIndex(dir, index);
+    scan("raw", dir, index);
+
+    Clock::time_point start = Clock::now();
+    long compressed = compressHistory(ip);
+    printf("compressHistory: %ld months in %.0f ms\n", compressed, seconds(start) * 1000);
+    loadIndex(dir, index);
+    scan("compressed", dir, index);
+    return 0;
+}
@@ -0,0 +1,85 @@
+// Cutting a text log into lines and fields: std::getline + find, as the
+// import did at first, a find per line over the mapping, and the table of
+// delimiters findDelimiters() builds at every SIMD level. Then the whole
+// importTextLog(), which also writes the segments. Usage: bench_import
+#include "bench_util.h"
+#include "test_util.h"
+
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+int main()
+{
+    enterScratchDir();
+    std::string text = textLog(60);
+    size_t lines = 0, fields = 0;
+
+    double time = best(3, [&]
+    {
+        std::istringstream in(text);
+        std::string line;
+        lines = fields = 0;
+        while (std::getline(in, line))
+        {
+            lines++;
+            for (size_t pos = 17, semi; (semi = line.find(';', pos)) != std::string::npos; pos = semi + 1)
+                fields++;
+        }
+    });
+    printf("getline + find          %8.0f MB/s  %6.2f M lines/s  (%zu lines, %zu fields)\n",
+           text.size() / time / 1e6, lines / time / 1e6, lines, fields);
+
+    time = best(3, [&]
+    {
+        std::string_view rest = text;
+        lines = fields = 0;
+        while (!rest.empty())
+        {
+            size_t newline = rest.find('\n');
+            std::string_view line = rest.substr(0, newline);
+            rest.remove_prefix(newline == std::string_view::npos ? rest.size() : newline + 1);
+            lines++;
+            for (size_t pos = 17, semi; (semi = line.find(';', pos)) != std::string_view::npos; pos = semi + 1)
+                fields++;
+        }
+    });
+    printf("find per line           %8.0f MB/s  %6.2f M lines/s\n", text.size() / time / 1e6, lines / time / 1e6);
+
+    const char* names[] = { "scalar", "SSE2", "AVX2" };
+    std::vector<uint32_t> offsets;
+    for (SimdLevel level : { SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2 })
+    {
+        if (level > simdLevel())
+            continue;
+        time = best(5, [&]
+        {
+            offsets.clear();
+            findDelimiters(text, '\n', ';', offsets, level);
+            // what the import does with the table: count lines and fields
+            lines = fields = 0;
+            size_t line_start = 0;
+            for (uint32_t offset : offsets)
+            {
+                if (text[offset] == '\n')
+                {
+                    lines++;
+                    line_start = offset + 1;
+                }
+                else if (offset >= line_start + 17)
+                    fields++;
+            }
+        });
+        printf("findDelimiters %-6s   %8.0f MB/s  %6.2f M lines/s  (%zu lines, %zu fields)\n", names[level],
+               text.size() / time / 1e6, lines / time / 1e6, lines, fields);
+    }
+
+    // every run imports a device of its own, an existing one is never imported
+    for (int run = 1; run <= 3; run++)
+        std::ofstream(textLogPath("10.0.9." + std::to_string(run)), std::ios::binary) << text;
+    long rows = 0;
+    int run = 0;
+    time = best(3, [&] { rows = importTextLog("10.0.9." + std::to_string(++run)); });
+    printf("importTextLog           %8.0f MB/s  %6.2f M rows/s\n", text.size() / time / 1e6, rows / time / 1e6);
+    return 0;
+}
@@ -0,0 +1,54 @@
+// Latency of a day and a month query, opening the device each time as the
+// server does for a new request, with 1 month, 1 year and 10 years of 5-minute
+// history behind it. It should not grow with the history. Usage: bench_lookup
+#include "bench_util.h"
+#include "test_util.h"
+
+#include <vector>
+
+int main()
+{
+    enterScratchDir();
+    struct History
+    {
+        const char* name;
+        const char* ip;
+        int months;
+    };
+    int64_t end = makeLocalTime(2025, 1, 1);
+    std::vector<std::string> labels = { "P", "V" };
+
+    for (History history : { History{ "1 month", "10.0.0.1", 1 }, History{ "1 year", "10.0.0.2", 12 },
+                             History{ "10 years", "10.0.0.3", 120 } })
+    {
+        {
+            DeviceWriter writer;
+            if (!writer.open(deviceDir(history.ip)))
+                return 1;
+            for (int64_t ts = makeLocalTime(2025, 1 - history.months, 1); ts < end; ts += 300)
+                writer.append(ts, labels, { (float)(ts / 300 % 1000), 230.0f });
+        }
+
+        // the newest full day and month, and a day in the middle of the history
+        int64_t last_day = end - 86400;
+        int64_t middle = makeLocalTime(2025, 1 - history.months / 2 - 1, 15);
+        int64_t month = makeLocalTime(2024, 12, 1);
+        size_t rows = 0;
+        auto query = [&](int64_t from, int64_t to)
+        {
+            return best(20, [&]
+            {
+                DeviceStore store;
+                store.open(history.ip);
+                rows = 0;
+                store.forEach(from, to, [&](int64_t, const float*) { rows++; });
+            });
+        };
+        double day_time = query(last_day, end);
+        double middle_time = query(middle, middle + 86400);
+        double month_time = query(month, end);
+        printf("%-9s  last day %6.0f us   middle day %6.0f us   last month %6.0f us  (%zu rows)\n",
+               history.name, day_time * 1e6, middle_time * 1e6, month_time * 1e6, rows);
+    }
+    return 0;
+}
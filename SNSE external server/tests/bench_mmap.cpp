@@ -0,0 +1,144 @@
+// std::ifstream against the read-only mappings: splitting a text log into
+// lines, and reading every row of a device's raw segments. The files were just
+// written, so both read from the page cache. Usage: bench_mmap [days, default 365]
+#include "bench_util.h"
+#include "test_util.h"
+
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+int main(int argc, char** argv)
+{
+    int days = argc > 1 ? atoi(argv[1]) : 365;
+    enterScratchDir();
+    const char* ip = "10.0.0.1";
+    std::string log = textLogPath(ip);
+    std::ofstream(log, std::ios::binary) << textLog(days, 300);
+    size_t log_size = fileSize(log);
+
+    size_t lines = 0, length = 0;
+    double time = best(5, [&]
+    {
+        std::ifstream in(log);
+        std::string line;
+        lines = length = 0;
+        while (std::getline(in, line))
+        {
+            std::string fields = line.substr(17);
+            length += fields.size();
+            lines++;
+        }
+    });
+    printf("ifstream + getline + substr   %6.1f M lines/s  %6.0f MB/s\n", lines / time / 1e6, log_size / time / 1e6);
+
+    time = best(5, [&]
+    {
+        MappedFile file;
+        file.open(log);
+        std::string_view rest = file.view();
+        lines = length = 0;
+        while (!rest.empty())
+        {
+            size_t newline = rest.find('\n');
+            std::string_view line = rest.substr(0, newline);
+            rest.remove_prefix(newline == std::string_view::npos ? rest.size() : newline + 1);
+            length += line.substr(17).size();
+            lines++;
+        }
+    });
+    printf("mmap + string_view            %6.1f M lines/s  %6.0f MB/s\n", lines / time / 1e6, log_size / time / 1e6);
+
+    if (importTextLog(ip) <= 0)
+        return 1;
+    std::string dir = deviceDir(ip);
+    std::vector<SegmentInfo> index;
+    loadIndex(dir, index);
+
+    // the records of a raw segment follow its header: timestamp, then the floats
+    size_t rows = 0;
+    double sum = 0;
+    time = best(5, [&]
+    {
+        std::vector<char> records(1 << 20);
+        rows = 0;
+        for (const SegmentInfo& info : index)
+        {
+            Segment segment;
+            segment.open(dir + info.name);
+            size_t record = sizeof(int64_t) + segment.sensorCount() * sizeof(float);
+            size_t header = fileSize(dir + info.name) - segment.rowCount() * record;
+            segment.close();
+
+            std::ifstream in(dir + info.name, std::ios::binary);
+            in.seekg(header);
+            while (in.read(records.data(), records.size() / record * record) || in.gcount() > 0)
+            {
+                size_t got = in.gcount() / record;
+                for (size_t r = 0; r < got; r++)
+                {
+                    float value;
+                    memcpy(&value, records.data() + r * record + sizeof(int64_t), sizeof(value));
+                    sum += value;
+                }
+                rows += got;
+            }
+        }
+    });
+    printf("segments, ifstream            %6.1f M rows/s   (%zu rows)\n", rows / time / 1e6, rows);
+
+    time = best(5, [&]
+    {
+        SampleBlock block;
+        rows = 0;
+        for (const SegmentInfo& info : index)
+        {
+            Segment segment;
+            segment.open(dir + info.name);
+            for (size_t row = 0; size_t got = segment.read(row, 4096, block); row += got)
+            {
+                for (size_t r = 0; r < got; r++)
+                    sum += block.row(r)[0];
+                rows += got;
+            }
+        }
+    });
+    printf("segments, mmap                %6.1f M rows/s%s\n", rows / time / 1e6, sum == 42 ? " " : "");
+
+    // binary searches for a timestamp, a seek and a read per probe with ifstream
+    Segment segment;
+    segment.open(dir + index[index.size() / 2].name);
+    size_t record = sizeof(int64_t) + segment.sensorCount() * sizeof(float);
+    size_t header = fileSize(dir + index[index.size() / 2].name) - segment.rowCount() * record;
+    int64_t first = segment.timestampAt(0);
+    int64_t span = segment.timestampAt(segment.rowCount() - 1) - first + 1;
+    const int searches = 100000;
+    size_t found = 0;
+    time = best(3, [&]
+    {
+        std::ifstream in(dir + index[index.size() / 2].name, std::ios::binary);
+        for (int i = 0; i < searches; i++)
+        {
+            int64_t target = first + (int64_t)i * 7919 % span;
+            size_t lo = 0, hi = segment.rowCount();
+            while (lo < hi)
+            {
+                size_t mid = (lo + hi) / 2;
+                int64_t ts;
+                in.seekg(header + mid * record);
+                in.read((char*)&ts, sizeof(ts));
+                if (ts < target) lo = mid + 1;
+                else hi = mid;
+            }
+            found += lo;
+        }
+    });
+    printf("lowerBound, ifstream          %6.2f us\n", time / searches * 1e6);
+    time = best(3, [&]
+    {
+        for (int i = 0; i < searches; i++)
+            found += segment.lowerBound(first + (int64_t)i * 7919 % span);
+    });
+    printf("lowerBound, mmap              %6.2f us%s\n", time / searches * 1e6, found == 42 ? " " : "");
+    return 0;
+}
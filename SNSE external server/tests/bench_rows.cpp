@@ -0,0 +1,96 @@
+// Rows per second of the row tokenizer (splitFields + parseFloat) against the
+// substr + strtof parsing it replaced, for 2, 8 and 32 sensors a row.
+// Usage: bench_rows
+#include "bench_util.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+// The parser before: a string per field, value and label copied out of it,
+// strtof, and the label searched from the first column
+static void parseOld(const std::string& line, const std::vector<std::string>& columns, std::vector<float>& row)
+{
+    std::vector<std::string> fields;
+    size_t pos = 17, semi;
+    while ((semi = line.find(";", pos)) != std::string::npos)
+    {
+        fields.push_back(line.substr(pos, semi - pos));
+        pos = semi + 1;
+    }
+    row.assign(columns.size(), NAN);
+    for (const std::string& field : fields)
+    {
+        size_t colon = field.find(":");
+        std::string value = field.substr(0, colon);
+        std::string label = colon != std::string::npos ? field.substr(colon + 1) : "";
+        size_t col = 0;
+        while (col < columns.size() && columns[col] != label)
+            col++;
+        if (col < columns.size())
+        {
+            char* end;
+            float parsed = strtof(value.c_str(), &end);
+            row[col] = end == value.c_str() ? NAN : parsed;
+        }
+    }
+}
+
+// The parser now, as importTextLog() and the getter run it
+static void parseNew(std::string_view line, const std::vector<std::string>& columns, std::vector<float>& row,
+                     std::vector<std::string_view>& fields)
+{
+    splitFields(line.substr(17), ';', fields);
+    row.assign(columns.size(), NAN);
+    for (size_t i = 0; i < fields.size(); i++)
+    {
+        size_t colon = fields[i].find(':');
+        std::string_view value = fields[i].substr(0, colon);
+        std::string_view label = colon == std::string_view::npos ? std::string_view() : fields[i].substr(colon + 1);
+        size_t col = i;
+        if (!label.empty() && (col >= columns.size() || columns[col] != label))
+        {
+            col = 0;
+            while (col < columns.size() && columns[col] != label)
+                col++;
+        }
+        if (col < columns.size())
+            row[col] = parseFloat(value);
+    }
+}
+
+int main()
+{
+    for (int sensors : { 2, 8, 32 })
+    {
+        std::string line = textLog(1, 86400, sensors);
+        line.pop_back();
+        std::vector<std::string> columns;
+        for (int s = 0; s < sensors; s++)
+            columns.push_back("graph_Sensor" + std::to_string(s));
+
+        const int rows = 200000;
+        std::vector<float> row;
+        std::vector<std::string_view> fields;
+        double sum = 0;
+        double old_time = best(3, [&]
+        {
+            for (int i = 0; i < rows; i++)
+            {
+                parseOld(line, columns, row);
+                sum += row[0];
+            }
+        });
+        double new_time = best(3, [&]
+        {
+            for (int i = 0; i < rows; i++)
+            {
+                parseNew(line, columns, row, fields);
+                sum += row[0];
+            }
+        });
+        printf("%2d sensors   substr + strtof %6.2f M rows/s   tokenizer %6.2f M rows/s%s\n", sensors,
+               rows / old_time / 1e6, rows / new_time / 1e6, sum == 42 ? " " : "");
+    }
+    return 0;
+}
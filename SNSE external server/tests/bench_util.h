@@ -0,0 +1,64 @@
+// Shared by the benchmarks in this directory, see run_benchmarks.sh
+#ifndef SNSE_BENCH_UTIL_H
+#define SNSE_BENCH_UTIL_H
+
+#include "../snse_storage.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <sys/stat.h>
+
+using Clock = std::chrono::steady_clock;
+
+inline double seconds(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Fastest of runs calls of task, in seconds
+template <typename Task>
+double best(int runs, Task task)
+{
+    double fastest = 1e30;
+    for (int i = 0; i < runs; i++)
+    {
+        Clock::time_point start = Clock::now();
+        task();
+        fastest = std::min(fastest, seconds(start));
+    }
+    return fastest;
+}
+
+inline size_t fileSize(const std::string& path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+// A log in the text format the getter used to write, one line every step
+// seconds from 2020 with the given number of sensors
+inline std::string textLog(int days, int step = 60, int sensors = 4)
+{
+    std::string text;
+    char field[64];
+    int64_t start = makeLocalTime(2020, 1, 1);
+    for (int64_t ts = start; ts < start + days * 86400LL; ts += step)
+    {
+        std::tm t = localTm(ts);
+        snprintf(field, sizeof(field), "%02d/%02d/%04d;%02d:%02d;", t.tm_mday, t.tm_mon + 1, t.tm_year + 1900,
+                 t.tm_hour, t.tm_min);
+        text += field;
+        float x = (float)(ts / step % 1000);
+        for (int s = 0; s < sensors; s++)
+        {
+            snprintf(field, sizeof(field), "%g:graph_Sensor%d;", x * (s + 1) + 0.25f, s);
+            text += field;
+        }
+        text += '\n';
+    }
+    return text;
+}
+
+#endif
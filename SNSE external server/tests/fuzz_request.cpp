@@ -0,0 +1,131 @@
+// Fuzz target for one request line, from parsing to the response. Checks that
+// every line gets whole "\r\n"-framed answers and nothing else.
+//
+// With libFuzzer (clang):
+//   clang++ -std=c++17 -g -O1 -pthread -DSNSE_DAEMON -fsanitize=fuzzer,address,undefined \
+//       -o fuzz_request fuzz_request.cpp ../snse_storage.cpp
+//   ./fuzz_request            (run from a directory with a devs/ to query)
+// As a plain driver, any compiler (see run_tests.sh):
+//   add -DSNSE_FUZZ_DRIVER and drop "fuzzer"; ./fuzz_request [iterations] [files...]
+//   mutates built-in seed lines, or replays the given files as inputs
+#include "server_util.h"
+
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    // the I/O thread splits on "\r\n", so a line never holds one
+    std::string line((const char*)data, size);
+    if (line.find("\r\n") != std::string::npos || line.size() > max_request_size)
+        return 0;
+
+    // one answer, or two for &latest (the list, then the newest period)
+    std::string response = respond(line);
+    if (!framed(response, 1) && !framed(response, 2))
+    {
+        fprintf(stderr, "Badly framed answer to \"%s\":\n\"%s\"\n", line.c_str(), response.c_str());
+        abort();
+    }
+    return 0;
+}
+
+#ifdef SNSE_FUZZ_DRIVER
+
+static const char* seeds[] = {
+    "GET ?dev=10.0.0.1&time=days",
+    "GET ?dev=10.0.0.1&time=days&data=02/01/2024",
+    "GET ?dev=10.0.0.1&time=days&data=02/01/2024&points=50",
+    "GET ?dev=10.0.0.1&time=months&latest",
+    "GET ?dev=10.0.0.1&time=months&data=01/2024",
+    "GET ?dev=10.0.0.1&time=years&data=2024",
+    "GET ?dev=10.0.0.1&from=1704067200&to=1704326400",
+    "GET ?dev=10.0.0.1&from=1704067200&to=1704326400&step=1h&value=energy",
+    "GET ?dev=10.0.0.1&from=1704067200&to=1704326400&step=1d&value=max",
+    "GET ?stats",
+    "POST ?dev=10.0.0.1",
+};
+
+static const char* tokens[] = {
+    "&", "=", "?", "dev", "time", "days", "months", "years", "data", "latest", "points", "from", "to",
+    "step", "value", "energy", "min", "max", "mean", "stats", "/", "0", "1", "-", "99999999999999999999",
+    "9223372036854775807", "-9223372036854775808", "s", "m", "h", "d", "\r", "\n", " ", "%", "..",
+};
+
+// A device with a few days of samples for the queries to find
+static void makeDevice()
+{
+    DeviceWriter writer;
+    writer.open(deviceDir("10.0.0.1"));
+    for (int64_t ts = makeLocalTime(2024, 1, 1); ts < makeLocalTime(2024, 1, 4); ts += 600)
+        writer.append(ts, { "graph_P", "graph_V" }, { (float)(ts % 1000), 230.0f });
+}
+
+static std::string mutate(std::mt19937& random, std::string line)
+{
+    int edits = 1 + random() % 4;
+    for (int i = 0; i < edits; i++)
+    {
+        size_t pos = line.empty() ? 0 : random() % (line.size() + 1);
+        switch (random() % 5)
+        {
+        case 0:
+            line.insert(pos, tokens[random() % (sizeof(tokens) / sizeof(tokens[0]))]);
+            break;
+        case 1:
+            if (pos < line.size())
+                line.erase(pos, 1 + random() % std::min<size_t>(8, line.size() - pos));
+            break;
+        case 2:
+            if (pos < line.size())
+                line[pos] = (char)random();
+            break;
+        case 3:
+        {
+            const std::string other = seeds[random() % (sizeof(seeds) / sizeof(seeds[0]))];
+            line = line.substr(0, pos) + other.substr(std::min<size_t>(pos, other.size()));
+            break;
+        }
+        default:
+            if (pos < line.size())
+                line.insert(pos, line.substr(pos, 1 + random() % 16));
+            break;
+        }
+    }
+    return line;
+}
+
+int main(int argc, char* argv[])
+{
+    char dir[] = "/tmp/snse_fuzz_XXXXXX";
+    if (mkdtemp(dir) == nullptr || chdir(dir) != 0 || mkdir("devs", 0755) != 0)
+        return 2;
+    makeDevice();
+
+    long iterations = argc > 1 ? atol(argv[1]) : 100000;
+    if (argc > 2)
+    {
+        for (int i = 2; i < argc; i++)
+        {
+            std::ifstream in(argv[i], std::ios::binary);
+            std::stringstream text;
+            text << in.rdbuf();
+            std::string input = text.str();
+            LLVMFuzzerTestOneInput((const uint8_t*)input.data(), input.size());
+        }
+        return 0;
+    }
+
+    std::mt19937 random(1234);
+    for (long i = 0; i < iterations; i++)
+    {
+        std::string line = mutate(random, seeds[random() % (sizeof(seeds) / sizeof(seeds[0]))]);
+        LLVMFuzzerTestOneInput((const uint8_t*)line.data(), line.size());
+    }
+    printf("fuzz_request: %ld inputs OK\n", iterations);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,19 @@
+#!/bin/sh
+# Builds every bench_*.cpp in this directory against the sources one level up
+# and runs it on the data it generates itself. Numbers are the best of a few
+# runs. Usage: tests/run_benchmarks.sh [build directory, default /tmp/snse_bench]
+# bench_clients needs a running snse_server and is only built:
+#   <build directory>/bench_clients <device ip> [clients] [loads per client]
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+src="$here/.."
+out=${1:-/tmp/snse_bench}
+mkdir -p "$out"
+
+for bench in "$here"/bench_*.cpp; do
+    name=$(basename "$bench" .cpp)
+    g++ -std=c++17 -O3 -Wall -pthread -DSNSE_DAEMON -o "$out/$name" "$bench" "$src/snse_storage.cpp"
+    [ "$name" = bench_clients ] && continue
+    echo "== $name"
+    "$out/$name"
+done
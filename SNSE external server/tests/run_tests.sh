@@ -0,0 +1,22 @@
+#!/bin/sh
+# Builds and runs every test_*.cpp in this directory against the sources one
+# level up. Usage: tests/run_tests.sh [build directory, default /tmp/snse_tests]
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+src="$here/.."
+out=${1:-/tmp/snse_tests}
+mkdir -p "$out"
+
+failed=0
+for test in "$here"/test_*.cpp; do
+    name=$(basename "$test" .cpp)
+    # tests of the server include its source, see server_util.h
+    g++ -std=c++17 -O2 -Wall -pthread -DSNSE_DAEMON -o "$out/$name" "$test" "$src/snse_storage.cpp"
+    "$out/$name" || failed=1
+done
+
+# a short run of the fuzz target as a plain driver, under the sanitizers
+g++ -std=c++17 -O1 -g -pthread -DSNSE_DAEMON -DSNSE_FUZZ_DRIVER -fsanitize=address,undefined \
+    -fno-sanitize-recover=undefined -o "$out/fuzz_request" "$here/fuzz_request.cpp" "$src/snse_storage.cpp"
+"$out/fuzz_request" 20000 || failed=1
+exit $failed
@@ -0,0 +1,35 @@
+// Request handlers of the server for the test drivers. The server is a single
+// translation unit without a header, so it is included whole; -DSNSE_DAEMON
+// leaves out its main().
+#ifndef SNSE_SERVER_UTIL_H
+#define SNSE_SERVER_UTIL_H
+
+#include "../snse_comm_server.cpp"
+
+// Everything handleRequest() sends back for one request line
+static std::string respond(const std::string& line)
+{
+    std::string response;
+    Output out([&](std::string&& chunk, bool) { response += chunk; });
+    handleRequest(out, line);
+    out.finish();
+    return response;
+}
+
+// True if response is count whole responses: each a status line, a body and
+// a "\r\n" that nothing else in the response contains
+static bool framed(const std::string& response, size_t count)
+{
+    size_t start = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t end = response.find("\r\n", start);
+        if (end == std::string::npos || end + 2 - start < 4 ||
+            !isdigit((unsigned char)response[start]) || response[start + 3] != ' ')
+            return false;
+        start = end + 2;
+    }
+    return start == response.size();
+}
+
+#endif
@@ -0,0 +1,87 @@
+// compactDevice(): sealed months are compressed, their rollups checked
+#include "../snse_storage.h"
+#include "test_util.h"
+
+#include <cmath>
+#include <fstream>
+#include <sstream>
+
+static std::string readFile(const std::string& path)
+{
+    std::ifstream in(path, std::ios::binary);
+    std::stringstream text;
+    text << in.rdbuf();
+    return text.str();
+}
+
+// January and the start of February at 5 minutes, with NaN now and then
+static void writeHistory(const char* ip)
+{
+    DeviceWriter writer;
+    CHECK(writer.open(deviceDir(ip)));
+    int64_t start = makeLocalTime(2024, 1, 1);
+    for (int64_t ts = start; ts < makeLocalTime(2024, 2, 3); ts += 300)
+    {
+        float x = (float)(ts / 300 % 1000);
+        CHECK(writer.append(ts, { "P", "V" }, { x / 3, ts % 7 == 0 ? NAN : 230.0f + x / 100 }));
+    }
+}
+
+// Rollups the writer kept up to date are left as they are
+static void keepsMatchingRollups()
+{
+    const char* ip = "10.0.4.1";
+    writeHistory(ip);
+    std::string dir = deviceDir(ip);
+    std::string rollups = readFile(dir + "2024-01.roll");
+
+    // every pass over a segment is paced before it starts
+    int paced = 0;
+    CHECK(compactDevice(ip, [&](size_t bytes)
+    {
+        Segment segment;
+        CHECK(segment.open(dir + "2024-01.snse") && !segment.isCompressed());
+        CHECK(bytes > 0);
+        paced++;
+    }));
+    CHECK(paced == 2);
+
+    Segment segment;
+    CHECK(segment.open(dir + "2024-01.snse") && segment.isCompressed());
+    CHECK(readFile(dir + "2024-01.roll") == rollups);
+}
+
+// Rollups with the right sample count but stale sums or max gap are rewritten
+static void repairsStaleRollups()
+{
+    const char* ip = "10.0.4.2";
+    writeHistory(ip);
+    std::string dir = deviceDir(ip);
+    std::string good = readFile(dir + "2024-01.roll");
+
+    SegmentRollups rollups;
+    CHECK(readRollups(dir + "2024-01.roll", rollups));
+    CHECK(!rollups.days.empty());
+    rollups.days[3].sensors[0].sum += 1;
+    rollups.month.sensors[0].sum += 1;
+    CHECK(writeRollups(dir + "2024-01.roll", rollups));
+    CHECK(compactDevice(ip, [](size_t) {}));
+    CHECK(readFile(dir + "2024-01.roll") == good);
+
+    // retention checks a compressed month again, here against another max gap
+    max_energy_gap = 600;
+    RetentionPolicy policy;
+    policy.raw_days = 1;
+    CHECK(applyRetention(ip, policy, makeLocalTime(2024, 2, 3)));
+    CHECK(readRollups(dir + "2024-01.roll", rollups));
+    CHECK(rollups.max_gap == 600);
+    max_energy_gap = default_max_energy_gap;
+}
+
+int main()
+{
+    enterScratchDir();
+    keepsMatchingRollups();
+    repairsStaleRollups();
+    return testResult("test_compaction");
+}
@@ -0,0 +1,103 @@
+// Compressed segments must read back exactly as the raw ones, see compressSegment()
+#include "../snse_storage.h"
+#include "test_util.h"
+
+#include <cmath>
+#include <cstring>
+#include <random>
+
+struct Rows
+{
+    std::vector<int64_t> timestamps;
+    std::vector<float> values;
+};
+
+static Rows readAll(const std::string& path)
+{
+    Segment segment;
+    SampleBlock block;
+    Rows rows;
+    CHECK(segment.open(path));
+    // odd sized reads so they start and end inside compressed blocks
+    for (size_t row = 0; size_t got = segment.read(row, 777, block); row += got)
+    {
+        rows.timestamps.insert(rows.timestamps.end(), block.timestamps.begin(), block.timestamps.end());
+        rows.values.insert(rows.values.end(), block.values.begin(), block.values.end());
+    }
+    return rows;
+}
+
+// Values that exercise every case of the XOR encoding: constants, small and
+// large changes, sign flips, NaN, infinities and denormals
+static float sampleValue(std::mt19937& rng, int sensor, int row)
+{
+    switch (sensor)
+    {
+    case 0: return 230.0f;
+    case 1: return row % 97 == 0 ? NAN : 100.0f + (float)(rng() % 1000) / 8;
+    case 2: return std::uniform_real_distribution<float>(-1e30f, 1e30f)(rng);
+    case 3: return row % 500 < 3 ? INFINITY : (row % 2 ? 1e-42f : -0.0f);
+    default: return (float)row;
+    }
+}
+
+static void roundTrip()
+{
+    const char* ip = "10.0.3.1";
+    std::mt19937 rng(7);
+    DeviceWriter writer;
+    CHECK(writer.open(deviceDir(ip)));
+
+    // irregular steps, from one second to an hour-long hole, across more than
+    // one block; the first sample of March only seals February
+    int64_t ts = makeLocalTime(2024, 2, 1);
+    std::vector<std::string> labels = { "V", "P", "X", "Y", "N" };
+    std::vector<float> values(labels.size());
+    for (int row = 0; row < 5000; row++)
+    {
+        for (size_t s = 0; s < labels.size(); s++)
+            values[s] = sampleValue(rng, (int)s, row);
+        CHECK(writer.append(ts, labels, values));
+        ts += row % 1000 == 999 ? 3600 : row % 3 == 0 ? 1 : 60 + rng() % 240;
+    }
+    CHECK(writer.append(makeLocalTime(2024, 3, 1), labels, values));
+    writer.close();
+
+    std::string path = deviceDir(ip) + "2024-02.snse";
+    Rows raw = readAll(path);
+    CHECK(raw.timestamps.size() == 5000);
+    Segment before;
+    CHECK(before.open(path));
+
+    CHECK(compressHistory(ip) == 1);
+    Segment after;
+    CHECK(after.open(path));
+    CHECK(after.isCompressed());
+    CHECK(after.labels == labels);
+    CHECK(after.rowCount() == 5000);
+
+    Rows packed = readAll(path);
+    CHECK(packed.timestamps == raw.timestamps);
+    CHECK(packed.values.size() == raw.values.size() &&
+          memcmp(packed.values.data(), raw.values.data(), raw.values.size() * sizeof(float)) == 0);
+
+    for (size_t row = 0; row < raw.timestamps.size(); row += 37)
+    {
+        CHECK(after.timestampAt(row) == raw.timestamps[row]);
+        CHECK(after.lowerBound(raw.timestamps[row]) == before.lowerBound(raw.timestamps[row]));
+        CHECK(after.lowerBound(raw.timestamps[row] + 1) == before.lowerBound(raw.timestamps[row] + 1));
+    }
+    CHECK(after.lowerBound(0) == 0);
+    CHECK(after.lowerBound(INT64_MAX) == 5000);
+
+    // an already compressed segment is left alone
+    CHECK(compressSegment(path));
+    CHECK(readAll(path).timestamps == raw.timestamps);
+}
+
+int main()
+{
+    enterScratchDir();
+    roundTrip();
+    return testResult("test_compression");
+}
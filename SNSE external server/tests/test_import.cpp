@@ -0,0 +1,77 @@
+// Imports of devs/<ip>.txt logs, see importTextLog()
+#include "../snse_storage.h"
+#include "test_util.h"
+
+#include <fstream>
+#include <csignal>
+
+static void writeLog(const std::string& ip, const std::string& text)
+{
+    std::ofstream(textLogPath(ip), std::ios::binary) << text;
+}
+
+static std::string logLines(int count)
+{
+    std::string text;
+    char line[64];
+    for (int i = 0; i < count; i++)
+    {
+        snprintf(line, sizeof(line), "01/01/2024;%02d:%02d;%d.5:graph_P;230:graph_V;\n", i / 12, i % 12 * 5, i);
+        text += line;
+    }
+    return text;
+}
+
+static void importsEveryLine()
+{
+    writeLog("10.0.0.1", logLines(100));
+    CHECK(importTextLog("10.0.0.1") == 100);
+
+    DeviceStore store;
+    CHECK(store.open("10.0.0.1"));
+    CHECK(store.rowCount() == 100);
+    CHECK((store.labels == std::vector<std::string>{ "graph_P", "graph_V" }));
+
+    int rows = 0;
+    store.forEach(0, INT64_MAX, [&](int64_t ts, const float* values)
+    {
+        CHECK(ts == makeLocalTime(2024, 1, 1) + rows * 300);
+        CHECK(values[0] == rows + 0.5f);
+        CHECK(values[1] == 230.0f);
+        rows++;
+    });
+    CHECK(rows == 100);
+
+    // the device exists now, a second import must not append to it
+    CHECK(importTextLog("10.0.0.1") == -1);
+}
+
+// A log cut off by a crash may end in a long run of bytes without newline.
+// It used to send the chunk loop back to the start of the file forever.
+static void unterminatedTailLongerThanAChunk()
+{
+    writeLog("10.0.0.2", logLines(10) + std::string(2 << 20, '\0'));
+    CHECK(importTextLog("10.0.0.2") == 10);
+
+    DeviceStore store;
+    CHECK(store.open("10.0.0.2"));
+    CHECK(store.rowCount() == 10);
+}
+
+// Lines with a newline in every chunk but one longer than a chunk
+static void lineLongerThanAChunk()
+{
+    writeLog("10.0.0.3", logLines(5) + std::string(3 << 20, 'x') + "\n" + logLines(5));
+    CHECK(importTextLog("10.0.0.3") == 10);
+}
+
+int main()
+{
+    // a hang is a failure too
+    alarm(30);
+    enterScratchDir();
+    importsEveryLine();
+    unterminatedTailLongerThanAChunk();
+    lineLongerThanAChunk();
+    return testResult("test_import");
+}
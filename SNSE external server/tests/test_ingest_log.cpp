@@ -0,0 +1,55 @@
+// IngestLog: rounds survive a reopen, a failed commit leaves nothing behind
+#include "../snse_storage.h"
+#include "test_util.h"
+
+#include <csignal>
+#include <sys/resource.h>
+
+static DeviceSample sample(const char* ip, int64_t ts, int sensors)
+{
+    DeviceSample s;
+    s.ip = ip;
+    s.timestamp = ts;
+    for (int i = 0; i < sensors; i++)
+    {
+        s.labels.push_back("graph_S" + std::to_string(i));
+        s.values.push_back((float)i);
+    }
+    return s;
+}
+
+static void failedCommitIsCutBack()
+{
+    IngestLog log;
+    CHECK(log.open("devs/ingest.wal", true));
+    CHECK(log.commit({ sample("10.0.0.1", 100, 2) }));
+
+    // a file size limit makes the next write fail part way through
+    signal(SIGXFSZ, SIG_IGN);
+    rlimit limit, saved;
+    getrlimit(RLIMIT_FSIZE, &saved);
+    limit = saved;
+    limit.rlim_cur = log.size() + 64;
+    setrlimit(RLIMIT_FSIZE, &limit);
+    size_t before = log.size();
+    CHECK(!log.commit({ sample("10.0.0.1", 200, 50) }));
+    CHECK(log.size() == before);
+    setrlimit(RLIMIT_FSIZE, &saved);
+
+    CHECK(log.commit({ sample("10.0.0.1", 300, 2), sample("10.0.0.2", 300, 1) }));
+    log.close();
+
+    IngestLog reopened;
+    CHECK(reopened.open("devs/ingest.wal", true));
+    std::vector<DeviceSample> pending = reopened.pending();
+    CHECK(pending.size() == 3);
+    CHECK(pending.size() == 3 && pending[0].timestamp == 100 && pending[1].timestamp == 300);
+    CHECK(pending.size() == 3 && pending[2].ip == "10.0.0.2" && pending[2].values.size() == 1);
+}
+
+int main()
+{
+    enterScratchDir();
+    failedCommitIsCutBack();
+    return testResult("test_ingest_log");
+}
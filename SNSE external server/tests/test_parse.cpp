@@ -0,0 +1,75 @@
+// The row tokenizer: splitFields(), parseFloat() and findDelimiters(), and formatValue()
+#include "../snse_storage.h"
+#include "test_util.h"
+
+#include <cmath>
+
+static void splitsFields()
+{
+    std::vector<std::string_view> fields;
+    splitFields("1.5:graph_P;230:graph_V;", ';', fields);
+    CHECK((fields == std::vector<std::string_view>{ "1.5:graph_P", "230:graph_V" }));
+    splitFields("a;;b", ';', fields);
+    CHECK((fields == std::vector<std::string_view>{ "a", "", "b" }));
+    splitFields("", ';', fields);
+    CHECK(fields.empty());
+}
+
+static void parsesFloats()
+{
+    CHECK(parseFloat("81.75 W") == 81.75f);
+    CHECK(parseFloat("  +12") == 12.0f);
+    CHECK(parseFloat("-0.5") == -0.5f);
+    CHECK(parseFloat("1e3") == 1000.0f);
+    CHECK(std::isnan(parseFloat("")));
+    CHECK(std::isnan(parseFloat("W")));
+    CHECK(std::isnan(parseFloat("nan")));
+}
+
+// Every instruction set finds the same delimiters as the scalar loop, whatever
+// the length and wherever the vectors end
+static void findsDelimiters()
+{
+    std::string text;
+    for (int i = 0; i < 300; i++)
+        text += i % 7 == 0 ? '\n' : i % 5 == 0 ? ';' : (char)('0' + i % 10);
+
+    for (size_t length = 0; length <= text.size(); length++)
+    {
+        std::vector<uint32_t> expected, got;
+        std::string_view data(text.data(), length);
+        findDelimiters(data, '\n', ';', expected, SIMD_SCALAR);
+        for (SimdLevel level : { SIMD_SSE2, SIMD_AVX2 })
+        {
+            if (level > simdLevel())
+                continue;
+            got.clear();
+            findDelimiters(data, '\n', ';', got, level);
+            CHECK(got == expected);
+        }
+    }
+}
+
+// Values go back to clients as the shortest decimal that reads back the same
+// float, without an exponent
+static void formatsValues()
+{
+    CHECK(formatValue(239.0f) == "239");
+    CHECK(formatValue(81.75f) == "81.75");
+    CHECK(formatValue(-0.5f) == "-0.5");
+    CHECK(formatValue(0.1f) == "0.1");
+    CHECK(formatValue(1e-5f) == "0.00001");
+    CHECK(formatValue(1e20f) == "100000002004087734272");
+    CHECK(formatValue(-3.4028235e38f).size() == 40);
+    CHECK(formatValue(NAN) == "nan");
+    CHECK(parseFloat(formatValue(1.17549435e-38f)) == 1.17549435e-38f);
+}
+
+int main()
+{
+    splitsFields();
+    parsesFloats();
+    findsDelimiters();
+    formatsValues();
+    return testResult("test_parse");
+}
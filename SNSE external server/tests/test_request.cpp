@@ -0,0 +1,100 @@
+// Request line parsing and the framing of every answer
+#include "server_util.h"
+#include "test_util.h"
+
+static void requestLines()
+{
+    Request request;
+    CHECK(parseRequestLine("GET ?dev=1.2.3.4&time=days&latest", request));
+    CHECK(request.method == "GET" && request.param_count == 3);
+    CHECK(request.params[0].key == "dev" && request.params[0].value == "1.2.3.4");
+    CHECK(request.params[2].key == "latest" && request.params[2].value.empty());
+    CHECK(parseRequestLine("GET ?stats", request) && request.param_count == 1);
+    CHECK(parseRequestLine("POST anything at all", request) && request.method == "POST");
+
+    CHECK(!parseRequestLine("", request));
+    CHECK(!parseRequestLine("GET", request));
+    CHECK(!parseRequestLine("get ?dev=x", request));
+    CHECK(!parseRequestLine("GET dev=x", request));
+    CHECK(!parseRequestLine("GET ?", request));
+    CHECK(!parseRequestLine("GET ?dev=x&&time=days", request));
+    CHECK(!parseRequestLine("GET ?dev=x&", request));
+    CHECK(!parseRequestLine("GET ?=x", request));
+    CHECK(!parseRequestLine("GET ?dev=x y", request));
+    CHECK(!parseRequestLine("GET ?dev=x\ty", request));
+    CHECK(!parseRequestLine("GET ?d.v=x", request));
+    CHECK(!parseRequestLine("GET ?a&b&c&d&e&f&g&h&i", request));
+    CHECK(!parseRequestLine("TOOLONGMETHOD ?a", request));
+}
+
+static void numbers()
+{
+    int64_t value;
+    CHECK(parseInteger("-5", value) && value == -5);
+    CHECK(parseInteger("1704067200", value) && value == 1704067200);
+    CHECK(!parseInteger("", value));
+    CHECK(!parseInteger("5x", value));
+    CHECK(!parseInteger(" 5", value));
+    CHECK(!parseInteger("99999999999999999999", value));
+
+    int64_t step;
+    CHECK(parseStep("30", step) && step == 30);
+    CHECK(parseStep("30s", step) && step == 30);
+    CHECK(parseStep("15m", step) && step == 900);
+    CHECK(parseStep("1h", step) && step == 3600);
+    CHECK(parseStep("366d", step) && step == 366 * 86400);
+    CHECK(!parseStep("367d", step));
+    CHECK(!parseStep("99999999999999999999d", step));
+    CHECK(!parseStep("0", step));
+    CHECK(!parseStep("-1h", step));
+    CHECK(!parseStep("1y", step));
+    CHECK(!parseStep("h", step));
+    CHECK(!parseStep("1hh", step));
+    CHECK(!parseStep("", step));
+}
+
+// Responses to pipelined requests are told apart by their "\r\n", so every
+// request has to get exactly one, whatever it is
+static void oneFramedAnswerEach()
+{
+    const char* invalid[] = {
+        "GET ?dev=9.9.9.9&time=foo",
+        "GET ?dev=9.9.9.9&time=foo&latest",
+        "GET ?dev=9.9.9.9&time=days&points=1",
+        "GET ?dev=9.9.9.9&time=days&bogus=1",
+        "GET ?dev=9.9.9.9&from=5&to=1",
+        "GET ?dev=9.9.9.9&from=-9223372036854775808&to=9223372036854775807",
+        "GET ?dev=9.9.9.9&from=0&to=100&step=99999999999999999999d",
+        "GET ?dev=9.9.9.9&from=0&to=100000000&step=1",
+        "GET ?dev=../etc&time=days",
+        "GET ?dev=9.9.9.9",
+        "GET ?time=days",
+        "GET ?dev=9.9.9.9&unknown=1",
+        "POST /anything",
+        "PUT ?dev=9.9.9.9",
+        "GET dev",
+        "",
+    };
+    for (const char* line : invalid)
+    {
+        std::string response = respond(line);
+        CHECK(framed(response, 1));
+        CHECK(response.compare(0, 4, "400 ") == 0);
+        if (!framed(response, 1) || response.compare(0, 4, "400 ") != 0)
+            std::cerr << "  for \"" << line << "\": \"" << response << "\"\n";
+    }
+
+    CHECK(framed(respond("GET ?dev=9.9.9.9&time=days"), 1));
+    CHECK(respond("GET ?dev=9.9.9.9&time=days").compare(0, 4, "404 ") == 0);
+    CHECK(framed(respond("GET ?dev=9.9.9.9&time=years&latest"), 2));
+    CHECK(framed(respond("GET ?stats"), 1));
+}
+
+int main()
+{
+    enterScratchDir();
+    requestLines();
+    numbers();
+    oneFramedAnswerEach();
+    return testResult("test_request");
+}
@@ -0,0 +1,122 @@
+// Hourly and rollup-only tiers of applyRetention()
+#include "../snse_storage.h"
+#include "test_util.h"
+
+#include <cmath>
+
+static const char* ip = "10.0.1.1";
+
+static bool near(double a, double b)
+{
+    return std::fabs(a - b) <= 1e-9 * std::max(1.0, std::fabs(a));
+}
+
+static bool same(const std::vector<Rollup>& a, const std::vector<Rollup>& b)
+{
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        if (a[i].start != b[i].start || a[i].samples != b[i].samples || a[i].sensors.size() != b[i].sensors.size())
+            return false;
+        for (size_t col = 0; col < a[i].sensors.size(); col++)
+        {
+            const SensorRollup& x = a[i].sensors[col];
+            const SensorRollup& y = b[i].sensors[col];
+            if (x.count != y.count || !near(x.sum, y.sum) || !near(x.energy, y.energy) ||
+                (x.count > 0 && (x.min != y.min || x.max != y.max)))
+                return false;
+        }
+    }
+    return true;
+}
+
+int main()
+{
+    enterScratchDir();
+
+    // January to March at 5 minutes, with a sensor that is NaN now and then
+    {
+        DeviceWriter writer;
+        CHECK(writer.open(deviceDir(ip)));
+        std::vector<std::string> labels = { "P", "V" };
+        for (int64_t ts = makeLocalTime(2024, 1, 1); ts < makeLocalTime(2024, 3, 20); ts += 300)
+        {
+            float p = (float)(ts / 300 % 97) * 10.0f;
+            float v = ts / 300 % 13 == 0 ? NAN : 220.0f + ts / 300 % 20;
+            CHECK(writer.append(ts, labels, { p, v }));
+        }
+    }
+
+    int64_t from = makeLocalTime(2024, 1, 1), to = makeLocalTime(2024, 3, 1);
+    std::vector<Rollup> hourly_before, months_before, days_before;
+    {
+        DeviceStore store;
+        CHECK(store.open(ip));
+        hourly_before = store.aggregate(from, to, 3600);
+        months_before = store.rollups(from, to, PERIOD_MONTH);
+        days_before = store.rollups(from, to, PERIOD_DAY);
+    }
+    CHECK(hourly_before.size() == 60 * 24);
+
+    // January and February move to the hourly tier, March is being appended to
+    RetentionPolicy policy;
+    policy.raw_days = 30;
+    CHECK(applyRetention(ip, policy, makeLocalTime(2024, 4, 15)));
+    {
+        DeviceStore store;
+        CHECK(store.open(ip));
+        CHECK(store.segments().size() == 3);
+        CHECK(store.segments()[0].name == "2024-01.hour.snse");
+        CHECK(store.segments()[1].name == "2024-02.hour.snse");
+
+        // energies, minimums and maximums are those of the samples, not of the means
+        std::vector<Rollup> hourly = store.aggregate(from, to, 3600);
+        CHECK(same(hourly, hourly_before));
+        CHECK(hourly.size() > 0 && hourly[5].sensors[0].energy > 0.0);
+        CHECK(hourly.size() > 0 && hourly[5].sensors[0].max > hourly[5].sensors[0].min);
+        CHECK(same(store.rollups(from, to, PERIOD_MONTH), months_before));
+
+        // two hour buckets are merged from the hour aggregates
+        std::vector<Rollup> two_hours = store.aggregate(from, to, 7200);
+        CHECK(two_hours.size() == hourly_before.size() / 2);
+
+        // day graphs of those months show the hour means
+        int rows = 0;
+        store.forEach(from, from + 86400, [&](int64_t ts, const float* values)
+        {
+            CHECK(ts == from + rows * 3600);
+            CHECK(values[0] == (float)(hourly_before[rows].sensors[0].sum / hourly_before[rows].sensors[0].count));
+            rows++;
+        });
+        CHECK(rows == 24);
+    }
+
+    // rollups lost after the swap are rebuilt from the hour aggregates
+    unlink((deviceDir(ip) + "2024-01.roll").c_str());
+    {
+        DeviceStore store;
+        CHECK(store.open(ip));
+        CHECK(same(store.rollups(from, to, PERIOD_MONTH), months_before));
+        CHECK(same(store.rollups(from, to, PERIOD_DAY), days_before));
+    }
+
+    // past the hourly limit only the rollups are left
+    policy.hourly_months = 1;
+    CHECK(applyRetention(ip, policy, makeLocalTime(2024, 4, 15)));
+    {
+        DeviceStore store;
+        CHECK(store.open(ip));
+        CHECK(store.segments()[0].name == "2024-01.roll");
+        CHECK(store.segments()[1].name == "2024-02.roll");
+        CHECK(same(store.rollups(from, to, PERIOD_MONTH), months_before));
+        CHECK(same(store.rollups(from, to, PERIOD_DAY), days_before));
+
+        // ranges fall back to the day rollups, one row per day whatever the step
+        CHECK(same(store.aggregate(from, to, 3600), days_before));
+        std::vector<Rollup> days_and_raw = store.aggregate(from, makeLocalTime(2024, 3, 2), 6 * 3600);
+        CHECK(days_and_raw.size() == days_before.size() + 4);
+        CHECK(days_and_raw.size() > 0 && days_and_raw.back().start == makeLocalTime(2024, 3, 1, 18));
+    }
+
+    return testResult("test_retention");
+}
@@ -0,0 +1,44 @@
+// Shared by the test drivers in this directory, see run_tests.sh
+#ifndef SNSE_TEST_UTIL_H
+#define SNSE_TEST_UTIL_H
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static int test_failures = 0;
+
+#define CHECK(cond)                                                                      \
+    do                                                                                   \
+    {                                                                                    \
+        if (!(cond))                                                                     \
+        {                                                                                \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed\n";   \
+            test_failures++;                                                             \
+        }                                                                                \
+    } while (0)
+
+// Storage paths are relative to the working directory, so every test runs in
+// a fresh directory of its own with an empty devs/ in it
+inline void enterScratchDir()
+{
+    char dir[] = "/tmp/snse_test_XXXXXX";
+    if (mkdtemp(dir) == nullptr || chdir(dir) != 0 || mkdir("devs", 0755) != 0)
+    {
+        std::cerr << "Cannot set up a scratch directory\n";
+        std::exit(2);
+    }
+}
+
+inline int testResult(const char* name)
+{
+    if (test_failures == 0)
+        std::cout << name << ": OK\n";
+    else
+        std::cout << name << ": " << test_failures << " checks failed\n";
+    return test_failures == 0 ? 0 : 1;
+}
+
+#endif
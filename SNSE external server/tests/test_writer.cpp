@@ -0,0 +1,90 @@
+// DeviceWriter: sensor sets that change within a month
+#include "../snse_storage.h"
+#include "test_util.h"
+
+#include <cmath>
+
+static void sensorAddedMidMonth()
+{
+    const char* ip = "10.0.2.1";
+    int64_t start = makeLocalTime(2024, 5, 1);
+    DeviceWriter writer;
+    CHECK(writer.open(deviceDir(ip)));
+    for (int i = 0; i < 100; i++)
+        CHECK(writer.append(start + i * 60, { "P" }, { (float)i }));
+
+    // a reader that has the segment open keeps its old, complete file
+    Segment before;
+    CHECK(before.open(deviceDir(ip) + "2024-05.snse"));
+
+    for (int i = 100; i < 200; i++)
+        CHECK(writer.append(start + i * 60, { "V", "P" }, { 230.0f, (float)i }));
+    CHECK((writer.labels() == std::vector<std::string>{ "P", "V" }));
+
+    CHECK(before.rowCount() == 100 && before.sensorCount() == 1);
+
+    DeviceStore store;
+    CHECK(store.open(ip));
+    CHECK(store.segments().size() == 1);
+    CHECK(store.rowCount() == 200);
+    CHECK((store.labels == std::vector<std::string>{ "P", "V" }));
+    int rows = 0;
+    store.forEach(0, INT64_MAX, [&](int64_t ts, const float* values)
+    {
+        CHECK(ts == start + rows * 60);
+        CHECK(values[0] == rows);
+        CHECK(rows < 100 ? std::isnan(values[1]) : values[1] == 230.0f);
+        rows++;
+    });
+    CHECK(rows == 200);
+
+    std::vector<Rollup> days = store.rollups(start, start + 86400, PERIOD_DAY);
+    CHECK(days.size() == 1);
+    CHECK(days.size() == 1 && days[0].samples == 200);
+    CHECK(days.size() == 1 && days[0].sensors[0].count == 200 && days[0].sensors[1].count == 100);
+    CHECK(days.size() == 1 && days[0].sensors[1].max == 230.0f);
+
+    // the rollups the writer keeps updating have the new sensor too
+    CHECK(writer.append(start + 200 * 60, { "P", "V" }, { 200.0f, 240.0f }));
+    DeviceStore later;
+    CHECK(later.open(ip));
+    days = later.rollups(start, start + 86400, PERIOD_DAY);
+    CHECK(days.size() == 1 && days[0].sensors[1].count == 101 && days[0].sensors[1].max == 240.0f);
+}
+
+// The first sample of a month without one of the sensors
+static void partialFirstSample()
+{
+    const char* ip = "10.0.2.2";
+    int64_t start = makeLocalTime(2024, 6, 1);
+    {
+        DeviceWriter writer;
+        CHECK(writer.open(deviceDir(ip)));
+        CHECK(writer.append(start, { "P" }, { 1.0f }));
+        for (int i = 1; i < 50; i++)
+            CHECK(writer.append(start + i * 60, { "P", "V" }, { 1.0f, 220.0f }));
+    }
+
+    // and once more after a restart
+    {
+        DeviceWriter writer;
+        CHECK(writer.open(deviceDir(ip)));
+        CHECK(writer.append(start + 50 * 60, { "P", "V", "I" }, { 1.0f, 220.0f, 5.0f }));
+    }
+
+    DeviceStore store;
+    CHECK(store.open(ip));
+    CHECK(store.rowCount() == 51);
+    CHECK((store.labels == std::vector<std::string>{ "P", "V", "I" }));
+    std::vector<Rollup> month = store.rollups(start, start + 31 * 86400, PERIOD_MONTH);
+    CHECK(month.size() == 1);
+    CHECK(month.size() == 1 && month[0].sensors[1].count == 50 && month[0].sensors[2].count == 1);
+}
+
+int main()
+{
+    enterScratchDir();
+    sensorAddedMidMonth();
+    partialFirstSample();
+    return testResult("test_writer");
+}